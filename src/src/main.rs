@@ -23,6 +23,8 @@ pub mod utility;
 
 use crate::cipher::*;
 use crate::options::CryptagraphOptions;
+use crate::search::graph_generate::GenerateOptions;
+use crate::search::search_properties::{search_properties, SearchOptions};
 use structopt::StructOpt;
 
 fn main() {
@@ -37,6 +39,24 @@ fn main() {
             file_mask_out,
             num_keep,
             file_graph,
+            spill_dir,
+            save_graph,
+            load_graph,
+            pack_graph,
+            meet_in_middle,
+            half_graph,
+            threshold,
+            targeted,
+            export,
+            export_binary,
+            aggregate,
+            subspace,
+            rounds_max,
+            checkpoint,
+            resume,
+            max_memory,
+            vertex_filter,
+            single_pass,
         } => {
             let cipher = match name_to_cipher(cipher.as_ref()) {
                 Some(c) => c,
@@ -46,17 +66,36 @@ fn main() {
                 }
             };
 
-            search::search_properties::search_properties(
-                cipher.as_ref(),
-                property_type,
-                rounds,
-                num_patterns,
-                anchors,
+            let options = SearchOptions {
                 file_mask_in,
                 file_mask_out,
                 num_keep,
                 file_graph,
-            );
+                spill_dir,
+                save_graph,
+                load_graph,
+                pack_graph,
+                meet_in_middle,
+                half_graph,
+                threshold,
+                targeted,
+                export,
+                export_binary,
+                aggregate,
+                subspace,
+                rounds_max,
+            };
+            let generate = GenerateOptions {
+                patterns: num_patterns,
+                anchors,
+                checkpoint,
+                resume,
+                max_memory,
+                vertex_filter,
+                single_pass,
+            };
+
+            search_properties(cipher.as_ref(), property_type, rounds, &options, &generate);
         }
         CryptagraphOptions::Dist {
             cipher,
@@ -64,6 +64,114 @@ pub enum CryptagraphOptions {
         Prefix of a path to dump the graph data to. The file generate is <file_graph>.graph.
         */
         file_graph: Option<String>,
+
+        #[structopt(long = "spill_dir")]
+        /**
+        Path to a directory in which to store the edges of the graph during the search for properties. Only the search benefits: the graph is still constructed in memory, so the peak memory of graph generation is unchanged, and its edges are only spilled once it is finished. The search then propagates inputs in batches whose rows fit in the memory budget given by <max_memory>, or 1 GiB by default, and reads each stage from disk once per batch. The files are removed once the search finishes.
+        */
+        spill_dir: Option<String>,
+
+        #[structopt(long = "save_graph")]
+        /**
+        Path to a file in which to save a binary snapshot of the generated graph. The snapshot can be searched again with <load_graph>.
+        */
+        save_graph: Option<String>,
+
+        #[structopt(long = "load_graph")]
+        /**
+        Path to a graph snapshot written with <save_graph>. If provided, the graph is loaded from the snapshot instead of being generated, and <patterns> and <anchors> are ignored. The snapshot must match the cipher, type and number of rounds.
+        */
+        load_graph: Option<String>,
+
+        #[structopt(long = "pack_graph")]
+        /**
+        If set, the edges of the finished graph are delta and varint encoded before searching for properties. This reduces memory usage at a small cost in speed.
+        */
+        pack_graph: bool,
+
+        #[structopt(long = "meet_in_middle")]
+        /**
+        If set together with <file_mask_in>, only the allowed input-output pairs are evaluated, by propagating forwards from the inputs and backwards from the outputs to the middle of the graph. Has no effect for Prince-like ciphers or when the graph is spilled.
+        */
+        meet_in_middle: bool,
+
+        #[structopt(long = "half_graph")]
+        /**
+        If set, properties of Prince-like ciphers are found by computing the hulls over the forward half of the graph once for all inputs, and combining them through the reflection layer. Has no effect for other ciphers or when the graph is spilled.
+        */
+        half_graph: bool,
+
+        #[structopt(long = "threshold")]
+        /**
+        Log2 of the smallest property value of interest. If provided, only properties with at least this value are returned, and partial trails which can't reach it on their own are dropped during the search. The values of the returned properties are then lower bounds, and properties close to the threshold may be missed. With <half_graph> or <meet_in_middle>, nothing is dropped during the search, and the threshold only filters the exact values found.
+        */
+        threshold: Option<f64>,
+
+        #[structopt(long = "targeted")]
+        /**
+        If set together with <file_mask_in>, the graph is first reduced to the paths between the allowed inputs and outputs. Useful when checking a short list of input-output pairs, in particular with a graph loaded using <load_graph>.
+        */
+        targeted: bool,
+
+        #[structopt(long = "export")]
+        /**
+        Log2 of a property value. If provided, every property with at least this value is streamed to the files <file_mask_out>.export.<n>.csv while searching, one file per thread. Requires <file_mask_out>.
+        */
+        export: Option<f64>,
+
+        #[structopt(long = "export_binary")]
+        /**
+        If set, exported properties are written to <file_mask_out>.export.<n>.bin in binary instead. Each property is stored as its input, output and number of trails as 128-bit integers, followed by its value as a 64-bit float, all little endian.
+        */
+        export_binary: bool,
+
+        #[structopt(long = "aggregate")]
+        /**
+        Sum the values of all properties found in groups, and dump the sums to <file_mask_out>.agg. Either "output" (sum over inputs for each output), "input" (sum over outputs for each input) or "subspace" (sum over the inputs in each coset of <subspace>, for each output). Requires <file_mask_out>.
+        */
+        aggregate: Option<String>,
+
+        #[structopt(long = "subspace")]
+        /**
+        Mask, in hexadecimals, whose set bits span the input subspace used by the "subspace" aggregation.
+        */
+        subspace: Option<String>,
+
+        #[structopt(long = "rounds_max")]
+        /**
+        If provided, the search is repeated for every number of rounds from <rounds> to <rounds_max> in a single run. The single-round edges are generated once and the graph is grown by one round at a time. Output files get the suffix .r<rounds> before their extension. Cannot be combined with <load_graph>.
+        */
+        rounds_max: Option<usize>,
+
+        #[structopt(long = "checkpoint")]
+        /**
+        Path to a file in which the state of graph generation is saved after each compression level, i.e. the vertex set, the graph and the remaining S-box patterns. Only used for more than four rounds.
+        */
+        checkpoint: Option<String>,
+
+        #[structopt(long = "resume")]
+        /**
+        If set, graph generation continues after the last level saved in <checkpoint>, or starts from scratch if no checkpoint was saved yet. The other arguments must match those of the interrupted run.
+        */
+        resume: bool,
+
+        #[structopt(long = "max_memory")]
+        /**
+        Memory budget for graph generation in GiB. If provided, the edges of each compression level are estimated from the number of properties and the edges observed in the previous level, and the S-box patterns kept for the next level are capped to stay within the budget, keeping those with the largest values. The number of anchors is capped likewise. With <spill_dir>, the budget also limits the rows of the inputs searched together. The estimates are approximate, so leave some margin.
+        */
+        max_memory: Option<f64>,
+
+        #[structopt(long = "vertex_filter")]
+        /**
+        If set, the inputs collected while finding the vertex set of each compression level are stored in a blocked Bloom filter instead of an exact set. This uses less memory and avoids merging the sets of each thread. The few vertices let through by false positives are removed when the graph is pruned.
+        */
+        vertex_filter: bool,
+
+        #[structopt(long = "single_pass")]
+        /**
+        If set, the inputs and outputs of the vertex set of each compression level are collected in a single parallel pass into shared concurrent sets, which are then intersected in parallel. This avoids waiting between the passes and merging on a single thread, at the cost of keeping all outputs in memory.
+        */
+        single_pass: bool,
     },
 
     #[structopt(name = "dist")]
@@ -0,0 +1,179 @@
+//! Aggregation of property values while they are being found.
+
+use fnv::FnvHashMap;
+use std::fs::OpenOptions;
+use std::io::{BufWriter, Write};
+use std::sync::Mutex;
+
+use crate::property::Property;
+
+/// The ways in which properties can be grouped when aggregating their values.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum Reducer {
+    /// Sum over all inputs for each output.
+    Output,
+    /// Sum over all outputs for each input.
+    Input,
+    /// Sum over the inputs in each coset of the subspace spanned by the set bits of the mask,
+    /// for each output.
+    Subspace(u128),
+}
+
+impl Reducer {
+    /// Returns the group of a property as a pair of input and output values.
+    fn key(self, property: &Property) -> (u128, u128) {
+        match self {
+            Reducer::Output => (0, property.output),
+            Reducer::Input => (property.input, 0),
+            Reducer::Subspace(mask) => (property.input & !mask, property.output),
+        }
+    }
+}
+
+/// The summed values and trails of a group of properties.
+#[derive(Clone, Copy, Debug, Default)]
+pub struct Sum {
+    /// The number of properties in the group.
+    pub count: usize,
+    /// The total number of trails.
+    pub trails: u128,
+    /// The total value.
+    pub value: f64,
+}
+
+impl Sum {
+    fn add(&mut self, other: &Sum) {
+        self.count += other.count;
+        self.trails += other.trails;
+        self.value += other.value;
+    }
+}
+
+/// Sums of property values in groups given by a reducer. Threads accumulate into their own
+/// `LocalAggregation` and merge it once they are done.
+pub struct Aggregation {
+    reducer: Reducer,
+    sums: Mutex<FnvHashMap<(u128, u128), Sum>>,
+}
+
+impl Aggregation {
+    /// Creates an empty aggregation.
+    pub fn new(reducer: Reducer) -> Aggregation {
+        Aggregation {
+            reducer,
+            sums: Mutex::new(FnvHashMap::default()),
+        }
+    }
+
+    /// Creates an empty thread local accumulator.
+    pub fn local(&self) -> LocalAggregation {
+        LocalAggregation {
+            reducer: self.reducer,
+            sums: FnvHashMap::default(),
+        }
+    }
+
+    /// Merges the sums of a thread local accumulator.
+    pub fn merge(&self, local: LocalAggregation) {
+        let mut sums = self.sums.lock().expect("Could not lock sums.");
+
+        for (key, sum) in &local.sums {
+            sums.entry(*key).or_insert_with(Sum::default).add(sum);
+        }
+    }
+
+    /// Returns the number of groups.
+    pub fn len(&self) -> usize {
+        self.sums.lock().expect("Could not lock sums.").len()
+    }
+
+    /// Check if there are no groups.
+    pub fn is_empty(&self) -> bool {
+        self.len() == 0
+    }
+
+    /// Returns the sum of a group given by input and output value. For `Reducer::Output`, the
+    /// input value is zero, and vice versa for `Reducer::Input`.
+    pub fn get(&self, input: u128, output: u128) -> Option<Sum> {
+        self.sums
+            .lock()
+            .expect("Could not lock sums.")
+            .get(&(input, output))
+            .cloned()
+    }
+
+    /// Dumps the sums to a file, with the largest values first. Each line holds the group, the
+    /// number of properties, the number of trails and the log2 of the value.
+    pub fn dump(&self, path: &str) {
+        let sums = self.sums.lock().expect("Could not lock sums.");
+        let mut sums: Vec<_> = sums.iter().collect();
+        sums.sort_by(|a, b| b.1.value.partial_cmp(&a.1.value).unwrap());
+
+        // Contents of previous files are overwritten
+        let file = OpenOptions::new()
+            .write(true)
+            .truncate(true)
+            .create(true)
+            .open(path)
+            .expect("Could not open file.");
+        let mut file = BufWriter::new(file);
+
+        for ((input, output), sum) in sums {
+            match self.reducer {
+                Reducer::Output => write!(file, "{:032x}", output),
+                Reducer::Input => write!(file, "{:032x}", input),
+                Reducer::Subspace(_) => write!(file, "({:032x},{:032x})", input, output),
+            }
+            .and_then(|_| writeln!(file, ",{},{},{}", sum.count, sum.trails, sum.value.log2()))
+            .expect("Could not write to file.");
+        }
+    }
+}
+
+/// Sums of property values accumulated by a single thread.
+pub struct LocalAggregation {
+    reducer: Reducer,
+    sums: FnvHashMap<(u128, u128), Sum>,
+}
+
+impl LocalAggregation {
+    /// Add a property to the sum of its group.
+    pub fn add(&mut self, property: &Property) {
+        let sum = self
+            .sums
+            .entry(self.reducer.key(property))
+            .or_insert_with(Sum::default);
+        sum.count += 1;
+        sum.trails += property.trails;
+        sum.value += property.value;
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{Aggregation, Reducer};
+    use crate::property::Property;
+
+    #[test]
+    fn subspace_sums_cosets() {
+        let aggregation = Aggregation::new(Reducer::Subspace(0x3));
+        let mut first = aggregation.local();
+        let mut second = aggregation.local();
+
+        for input in 0..8 {
+            first.add(&Property::new(input, 1, 0.25, 1));
+            second.add(&Property::new(input, 2, 0.125, 2));
+        }
+
+        aggregation.merge(first);
+        aggregation.merge(second);
+
+        assert_eq!(aggregation.len(), 4);
+
+        let sum = aggregation.get(0x4, 1).unwrap();
+        assert_eq!((sum.count, sum.trails, sum.value), (4, 4, 1.0));
+
+        let sum = aggregation.get(0x0, 2).unwrap();
+        assert_eq!((sum.count, sum.trails, sum.value), (4, 8, 0.5));
+    }
+}
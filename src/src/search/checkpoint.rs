@@ -0,0 +1,258 @@
+//! Checkpoints of graph generation, from which generation can be resumed after the last
+//! completed compression level.
+
+use fnv::FnvHashSet;
+use std::fs::{self, File};
+use std::io::{BufReader, BufWriter, Read, Write};
+use std::path::Path;
+
+use crate::cipher::Cipher;
+use crate::property::PropertyType;
+use crate::search::graph::MultistageGraph;
+use crate::search::graph_frozen::{property_type_id, read_u64, write_u64};
+use crate::search::patterns::SboxPattern;
+
+// Checkpoints start with this identifier, followed by the format version
+const CHECKPOINT_MAGIC: &[u8; 8] = b"CGCHKPNT";
+const CHECKPOINT_VERSION: u64 = 1;
+
+/// Writes a 128-bit integer in little-endian byte order.
+fn write_u128<W: Write>(writer: &mut W, x: u128) {
+    writer
+        .write_all(&x.to_le_bytes())
+        .expect("Could not write to file.");
+}
+
+/// Reads a 128-bit integer in little-endian byte order.
+fn read_u128<R: Read>(reader: &mut R) -> u128 {
+    let mut buffer = [0; 16];
+    reader
+        .read_exact(&mut buffer)
+        .expect("Could not read from file.");
+    u128::from_le_bytes(buffer)
+}
+
+/// The state of graph generation after a completed compression level.
+pub struct Level {
+    pub level: usize,
+    pub vertex_set: FnvHashSet<u128>,
+    pub graph: MultistageGraph,
+    pub patterns: Vec<SboxPattern>,
+}
+
+/// A checkpoint file for generating the graph of a given cipher, property type, number of
+/// rounds and number of patterns. Only the last completed level is kept.
+pub struct Checkpoint<'a> {
+    path: String,
+    cipher: &'a dyn Cipher,
+    property_type: PropertyType,
+    rounds: usize,
+    patterns: usize,
+}
+
+impl<'a> Checkpoint<'a> {
+    /// Creates a checkpoint stored at `path`. Nothing is written until a level is saved.
+    pub fn new(
+        path: &str,
+        cipher: &'a dyn Cipher,
+        property_type: PropertyType,
+        rounds: usize,
+        patterns: usize,
+    ) -> Checkpoint<'a> {
+        Checkpoint {
+            path: path.to_string(),
+            cipher,
+            property_type,
+            rounds,
+            patterns,
+        }
+    }
+
+    /// Saves the state after a completed level. The checkpoint is written to a temporary file
+    /// first, so that the previous level is kept if the process is killed while saving.
+    pub fn save(
+        &self,
+        level: usize,
+        vertex_set: &FnvHashSet<u128>,
+        graph: &MultistageGraph,
+        patterns: &[SboxPattern],
+    ) {
+        let tmp_path = format!("{}.tmp", self.path);
+        let mut file = BufWriter::new(File::create(&tmp_path).expect("Could not create file."));
+        let name = self.cipher.name();
+
+        file.write_all(CHECKPOINT_MAGIC)
+            .expect("Could not write to file.");
+        write_u64(&mut file, CHECKPOINT_VERSION);
+        write_u64(&mut file, name.len() as u64);
+        file.write_all(name.as_bytes())
+            .expect("Could not write to file.");
+        write_u64(&mut file, property_type_id(self.property_type));
+        write_u64(&mut file, self.rounds as u64);
+        write_u64(&mut file, self.patterns as u64);
+        write_u64(&mut file, level as u64);
+
+        write_u64(&mut file, vertex_set.len() as u64);
+        for &v in vertex_set {
+            write_u128(&mut file, v);
+        }
+
+        write_u64(&mut file, patterns.len() as u64);
+        for pattern in patterns {
+            let active = pattern.active();
+            write_u64(&mut file, pattern.value().to_bits());
+            write_u64(&mut file, active.len() as u64);
+
+            for (i, x) in active {
+                write_u64(&mut file, i as u64);
+                write_u64(&mut file, x as i64 as u64);
+            }
+        }
+
+        write_u64(&mut file, graph.stages() as u64);
+        let num_entries: usize = graph.forward_edges().iter().map(|heads| heads.len()).sum();
+        write_u64(&mut file, num_entries as u64);
+        for (tail, heads) in graph.forward_edges().iter().enumerate() {
+            for (&head, &(stages, length)) in heads {
+                write_u128(&mut file, graph.label(tail as u32));
+                write_u128(&mut file, graph.label(head));
+                write_u64(&mut file, stages);
+                write_u64(&mut file, length.to_bits());
+            }
+        }
+
+        file.flush().expect("Could not write to file.");
+        drop(file);
+        fs::rename(&tmp_path, &self.path).expect("Could not write checkpoint.");
+    }
+
+    /// Loads the state after the last completed level, or returns `None` if there is no
+    /// checkpoint yet.
+    ///
+    /// # Panics
+    /// Panics if the file isn't a checkpoint of the current version, or if it was written for a
+    /// different cipher, property type, number of rounds or number of patterns.
+    pub fn load(&self) -> Option<Level> {
+        if !Path::new(&self.path).exists() {
+            return None;
+        }
+
+        let mut file = BufReader::new(File::open(&self.path).expect("Could not open file."));
+
+        let mut magic = [0; 8];
+        file.read_exact(&mut magic)
+            .expect("Could not read from file.");
+
+        if &magic != CHECKPOINT_MAGIC {
+            panic!("File is not a checkpoint.");
+        }
+
+        if read_u64(&mut file) != CHECKPOINT_VERSION {
+            panic!("Checkpoint version is not supported.");
+        }
+
+        let mut name = vec![0; read_u64(&mut file) as usize];
+        file.read_exact(&mut name)
+            .expect("Could not read from file.");
+
+        if name != self.cipher.name().as_bytes()
+            || read_u64(&mut file) != property_type_id(self.property_type)
+            || read_u64(&mut file) != self.rounds as u64
+            || read_u64(&mut file) != self.patterns as u64
+        {
+            panic!("Checkpoint was written for a different cipher, type, rounds or patterns.");
+        }
+
+        let level = read_u64(&mut file) as usize;
+
+        let num_vertices = read_u64(&mut file) as usize;
+        let vertex_set = (0..num_vertices).map(|_| read_u128(&mut file)).collect();
+
+        let num_patterns = read_u64(&mut file) as usize;
+        let patterns = (0..num_patterns)
+            .map(|_| {
+                let value = f64::from_bits(read_u64(&mut file));
+                let num_active = read_u64(&mut file) as usize;
+                let active: Vec<_> = (0..num_active)
+                    .map(|_| {
+                        let i = read_u64(&mut file) as usize;
+                        let x = read_u64(&mut file) as i64 as i16;
+                        (i, x)
+                    })
+                    .collect();
+
+                SboxPattern::from_active(self.cipher, &active, value)
+            })
+            .collect();
+
+        let mut graph = MultistageGraph::new(read_u64(&mut file) as usize);
+        let num_entries = read_u64(&mut file) as usize;
+        for _ in 0..num_entries {
+            let tail = read_u128(&mut file);
+            let head = read_u128(&mut file);
+            let stages = read_u64(&mut file);
+            let length = f64::from_bits(read_u64(&mut file));
+            graph.add_edges(tail, head, stages, length);
+        }
+
+        Some(Level {
+            level,
+            vertex_set,
+            graph,
+            patterns,
+        })
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::Checkpoint;
+    use crate::cipher::name_to_cipher;
+    use crate::property::{PropertyFilter, PropertyType};
+    use crate::search::graph::MultistageGraph;
+    use crate::search::single_round::SortedProperties;
+    use fnv::FnvHashSet;
+
+    #[test]
+    fn checkpoint_round_trips() {
+        let cipher = name_to_cipher("present").expect("Cipher not found.");
+        let properties = SortedProperties::new(
+            cipher.as_ref(),
+            20,
+            PropertyType::Linear,
+            PropertyFilter::All,
+        );
+        let vertex_set: FnvHashSet<u128> = (0..100).map(|v| v * 0x1_0000_0001).collect();
+        let mut graph = MultistageGraph::new(3);
+
+        for v in 0..100 {
+            graph.add_edges(v, (v * 7) % 50, 1 << (v % 3), 1.0 / (v + 1) as f64);
+        }
+
+        let path = std::env::temp_dir().join(format!("checkpoint_{}", std::process::id()));
+        let path = path.to_str().expect("Invalid path.");
+        let checkpoint = Checkpoint::new(path, cipher.as_ref(), PropertyType::Linear, 5, 20);
+
+        assert!(checkpoint.load().is_none());
+        checkpoint.save(2, &vertex_set, &graph, properties.patterns());
+        let level = checkpoint.load().expect("Checkpoint not found.");
+        std::fs::remove_file(path).expect("Could not remove file.");
+
+        assert_eq!(level.level, 2);
+        assert_eq!(level.vertex_set, vertex_set);
+        assert_eq!(level.graph.num_edges(), graph.num_edges());
+        assert_eq!(level.patterns.len(), properties.len_patterns());
+
+        for (a, b) in level.patterns.iter().zip(properties.patterns()) {
+            assert_eq!(a.active(), b.active());
+            assert_eq!(a.value(), b.value());
+        }
+
+        for v in 0..100 {
+            assert_eq!(
+                level.graph.get_edge(v, (v * 7) % 50),
+                graph.get_edge(v, (v * 7) % 50)
+            );
+        }
+    }
+}
@@ -0,0 +1,102 @@
+//! Streaming of properties to files while they are being found.
+
+use std::fs::{File, OpenOptions};
+use std::io::{BufWriter, Write};
+use std::sync::atomic::{AtomicUsize, Ordering};
+
+use crate::property::Property;
+
+/// Settings for streaming every property with at least a given value to files. Each writer,
+/// i.e. each thread, writes to its own file, `<prefix>.<n>.csv` or `<prefix>.<n>.bin`, so no
+/// locking is needed.
+pub struct Export {
+    prefix: String,
+    value: f64,
+    binary: bool,
+    writers: AtomicUsize,
+}
+
+impl Export {
+    /// Creates settings for exporting properties with at least `value` to files starting with
+    /// `prefix`. If `binary` is set, each property is written as its input, output and number
+    /// of trails as little endian 128-bit integers followed by its value as a little endian
+    /// 64-bit float. Otherwise properties are written in the same format as the .app file.
+    pub fn new(prefix: &str, value: f64, binary: bool) -> Export {
+        Export {
+            prefix: prefix.to_string(),
+            value,
+            binary,
+            writers: AtomicUsize::new(0),
+        }
+    }
+
+    /// Returns the prefix of the exported files.
+    pub fn prefix(&self) -> &str {
+        &self.prefix
+    }
+
+    /// Opens a new file and returns a buffered writer for it.
+    pub fn writer(&self) -> ExportWriter {
+        let index = self.writers.fetch_add(1, Ordering::Relaxed);
+        let extension = if self.binary { "bin" } else { "csv" };
+        let path = format!("{}.{}.{}", self.prefix, index, extension);
+
+        // Contents of previous files are overwritten
+        let file = OpenOptions::new()
+            .write(true)
+            .truncate(true)
+            .create(true)
+            .open(path)
+            .expect("Could not open file.");
+
+        ExportWriter {
+            file: BufWriter::new(file),
+            value: self.value,
+            binary: self.binary,
+            count: 0,
+        }
+    }
+}
+
+/// Writes properties to a single export file.
+pub struct ExportWriter {
+    file: BufWriter<File>,
+    value: f64,
+    binary: bool,
+    count: usize,
+}
+
+impl ExportWriter {
+    /// Write a property to the file if its value is at least the export value.
+    pub fn write(&mut self, property: &Property) {
+        if property.value < self.value {
+            return;
+        }
+
+        if self.binary {
+            self.file
+                .write_all(&property.input.to_le_bytes())
+                .and_then(|_| self.file.write_all(&property.output.to_le_bytes()))
+                .and_then(|_| self.file.write_all(&property.trails.to_le_bytes()))
+                .and_then(|_| self.file.write_all(&property.value.to_le_bytes()))
+                .expect("Could not write to file.");
+        } else {
+            writeln!(
+                self.file,
+                "{:?},{},{}",
+                property,
+                property.trails,
+                property.value.log2()
+            )
+            .expect("Could not write to file.");
+        }
+
+        self.count += 1;
+    }
+
+    /// Flushes the file and returns the number of properties written to it.
+    pub fn finish(mut self) -> usize {
+        self.file.flush().expect("Could not write to file.");
+        self.count
+    }
+}
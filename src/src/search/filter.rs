@@ -0,0 +1,86 @@
+//! A probabilistic set of masks, used in place of exact sets where false positives are harmless.
+
+use std::sync::atomic::{AtomicU64, Ordering};
+
+// Bits of filter per expected element, giving a false positive rate of about 0.1%
+const BITS_PER_ELEMENT: usize = 16;
+
+// Each block is a cache line of eight words
+const BLOCK_WORDS: usize = 8;
+
+/// Finalising mixer of SplitMix64.
+fn mix(mut x: u64) -> u64 {
+    x = (x ^ (x >> 30)).wrapping_mul(0xbf58_476d_1ce4_e5b9);
+    x = (x ^ (x >> 27)).wrapping_mul(0x94d0_49bb_1331_11eb);
+    x ^ (x >> 31)
+}
+
+/// A split block Bloom filter. Each element selects a block of eight words and sets one bit in
+/// each word. Elements can be inserted concurrently from several threads. Membership tests may
+/// return false positives, but never false negatives.
+pub struct BlockedBloom {
+    words: Vec<AtomicU64>,
+    num_blocks: u64,
+}
+
+impl BlockedBloom {
+    /// Creates an empty filter sized for a given number of elements.
+    pub fn new(expected: usize) -> BlockedBloom {
+        let num_blocks = (expected * BITS_PER_ELEMENT / (64 * BLOCK_WORDS)).max(1);
+
+        BlockedBloom {
+            words: (0..num_blocks * BLOCK_WORDS)
+                .map(|_| AtomicU64::new(0))
+                .collect(),
+            num_blocks: num_blocks as u64,
+        }
+    }
+
+    /// Returns the index of the first word of the block of `x` and the bits selected in it.
+    fn locate(&self, x: u128) -> (usize, u64) {
+        let hash = mix(x as u64 ^ mix((x >> 64) as u64));
+        let block = ((u128::from(hash) * u128::from(self.num_blocks)) >> 64) as usize;
+
+        (block * BLOCK_WORDS, mix(hash))
+    }
+
+    /// Inserts an element into the filter.
+    pub fn insert(&self, x: u128) {
+        let (start, bits) = self.locate(x);
+
+        for (i, word) in self.words[start..start + BLOCK_WORDS].iter().enumerate() {
+            word.fetch_or(1 << ((bits >> (6 * i)) & 63), Ordering::Relaxed);
+        }
+    }
+
+    /// Checks whether an element may have been inserted into the filter.
+    pub fn contains(&self, x: u128) -> bool {
+        let (start, bits) = self.locate(x);
+
+        self.words[start..start + BLOCK_WORDS]
+            .iter()
+            .enumerate()
+            .all(|(i, word)| word.load(Ordering::Relaxed) & (1 << ((bits >> (6 * i)) & 63)) != 0)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::BlockedBloom;
+
+    #[test]
+    fn bloom_has_no_false_negatives() {
+        let filter = BlockedBloom::new(10_000);
+
+        for x in 0..10_000u128 {
+            filter.insert(x << 60);
+        }
+
+        assert!((0..10_000u128).all(|x| filter.contains(x << 60)));
+
+        let false_positives = (10_000..110_000u128)
+            .filter(|&x| filter.contains(x << 60))
+            .count();
+        assert!(false_positives < 2_000);
+    }
+}
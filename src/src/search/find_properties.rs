@@ -1,16 +1,21 @@
 //! Functions for searching for properties once a graph has been generated.
 
 use crossbeam_utils;
-use fnv::FnvHashSet;
-use indexmap::IndexMap;
+use fnv::{FnvHashMap, FnvHashSet};
+use indexmap::IndexSet;
 use num_cpus;
+use std::cmp::{Ordering, Reverse};
+use std::collections::BinaryHeap;
 use std::f64;
+use std::sync::atomic::{AtomicU64, AtomicUsize, Ordering as AtomicOrdering};
 use std::sync::mpsc;
 use std::time::Instant;
 
 use crate::cipher::{Cipher, CipherStructure};
 use crate::property::{Property, PropertyType};
-use crate::search::graph::MultistageGraph;
+use crate::search::aggregate::{Aggregation, LocalAggregation};
+use crate::search::export::{Export, ExportWriter};
+use crate::search::graph_frozen::{Adjacency, FrozenGraph};
 use crate::utility::ProgressBar;
 
 // The number of threads used for parallel calls is fixed
@@ -18,187 +23,1175 @@ lazy_static! {
     static ref THREADS: usize = num_cpus::get();
 }
 
-/// Find all properties for a given graph starting with a specific input value.
+// The memory in bytes the rows of a batch of inputs may take up when streaming a spilled graph,
+// unless another budget is given
+const STREAM_BUDGET: f64 = (1u64 << 30) as f64;
+
+/// A sparse row of the product of the stage matrices of a graph for a single input value. Each
+/// entry holds the index of an output vertex and the property leading to it. Entries are kept
+/// in the order the outputs were first reached, so that values are summed in the same order
+/// however the row is computed.
+type SparseRow = Vec<(u32, Property)>;
+
+// Marks vertices without an entry in the row currently being multiplied
+const NO_ENTRY: u32 = std::u32::MAX;
+
+/// Creates a sparse row containing only the "empty" property of an input vertex, reusing the
+/// buffer of an old row.
+fn start_row(graph: &FrozenGraph, input: usize, mut row: SparseRow) -> SparseRow {
+    let input_label = graph.vertices(0)[input];
+    row.clear();
+    row.push((
+        input as u32,
+        Property::new(input_label, input_label, 1.0, 1),
+    ));
+    row
+}
+
+/// Multiplies a row by the sparse matrix of a single stage, given by `edges`, and writes the
+/// result to `product`. `outputs` are the labels of the vertices the edges lead to. The product
+/// is accumulated using a dense scratch array, `position`, which maps output vertices to
+/// entries of the product. It must be at least as long as `outputs` and is left cleared.
+fn multiply_row(
+    row: &[(u32, Property)],
+    product: &mut SparseRow,
+    edges: &Adjacency,
+    outputs: &[u128],
+    property_type: PropertyType,
+    position: &mut [u32],
+) {
+    product.clear();
+
+    for &(vertex, property) in row {
+        for (new_output, length) in edges.edges(vertex as usize) {
+            let new_value = match property_type {
+                PropertyType::Linear => length,
+                PropertyType::Differential => length,
+            };
+
+            if position[new_output] == NO_ENTRY {
+                position[new_output] = product.len() as u32;
+                product.push((
+                    new_output as u32,
+                    Property::new(property.input, outputs[new_output], 0.0, 0),
+                ));
+            }
+
+            let entry = &mut product[position[new_output] as usize].1;
+            entry.trails += property.trails;
+            entry.value += property.value * new_value;
+        }
+    }
+
+    // Only the touched positions need to be cleared
+    for &(output, _) in product.iter() {
+        position[output as usize] = NO_ENTRY;
+    }
+}
+
+/// Multiplies each of `rows` by the sparse matrix of a single stage, given by `edges`.
+/// `outputs` are the labels of the vertices the edges lead to, and `position` is scratch space
+/// for `multiply_row`. The products are written to buffers taken from `spare`, and the buffers
+/// of the old rows are returned to it, so no allocations are made once the buffers have grown.
+fn multiply_rows(
+    rows: &mut [SparseRow],
+    spare: &mut Vec<SparseRow>,
+    edges: &Adjacency,
+    outputs: &[u128],
+    property_type: PropertyType,
+    position: &mut Vec<u32>,
+) {
+    if position.len() < outputs.len() {
+        position.resize(outputs.len(), NO_ENTRY);
+    }
+
+    for row in rows.iter_mut() {
+        let mut product = spare.pop().unwrap_or_default();
+        multiply_row(row, &mut product, edges, outputs, property_type, position);
+        spare.push(std::mem::replace(row, product));
+    }
+}
+
+/// Apply the reflection layer of a Prince-like cipher to the outputs of a sparse row, in place.
+/// Outputs whose reflection isn't a vertex of the last stage are dropped.
+fn reflect_row(cipher: &dyn Cipher, graph: &FrozenGraph, row: &mut SparseRow) {
+    let stages = graph.stages();
+    let mut kept = 0;
+
+    for i in 0..row.len() {
+        let (k, v) = row[i];
+        let reflected = cipher.reflection_layer(graph.vertices(stages)[k as usize]);
+
+        if let Some(k) = graph.vertex_index(reflected, stages) {
+            row[kept] = (k as u32, v);
+            kept += 1;
+        }
+    }
+
+    row.truncate(kept);
+}
+
+/// Reusable buffers for propagating the properties of one input value at a time through a
+/// graph. The frontier is double buffered and the scratch array is cleared in time proportional
+/// to the number of entries, so once the buffers have grown to size, no allocations are made.
+struct Frontier {
+    current: SparseRow,
+    next: SparseRow,
+    position: Vec<u32>,
+}
+
+impl Frontier {
+    /// Creates empty buffers for searching a graph.
+    fn new(graph: &FrozenGraph) -> Frontier {
+        let max_vertices = (0..=graph.stages())
+            .map(|stage| graph.num_vertices(stage))
+            .max()
+            .unwrap_or(0);
+
+        Frontier {
+            current: Vec::new(),
+            next: Vec::new(),
+            position: vec![NO_ENTRY; max_vertices],
+        }
+    }
+
+    /// Resets the frontier to the "empty" property of an input vertex.
+    fn start(&mut self, graph: &FrozenGraph, input: usize) {
+        let input_label = graph.vertices(0)[input];
+        self.current.clear();
+        self.current.push((
+            input as u32,
+            Property::new(input_label, input_label, 1.0, 1),
+        ));
+    }
+
+    /// Extend the frontier by one stage. `edges` are the edges of the stage, and `outputs` are
+    /// the labels of the vertices the edges lead to.
+    fn extend(&mut self, edges: &Adjacency, outputs: &[u128], property_type: PropertyType) {
+        multiply_row(
+            &self.current,
+            &mut self.next,
+            edges,
+            outputs,
+            property_type,
+            &mut self.position,
+        );
+        std::mem::swap(&mut self.current, &mut self.next);
+    }
+
+    /// Returns the properties currently in the frontier.
+    fn properties(&self) -> impl ExactSizeIterator<Item = &Property> {
+        self.current.iter().map(|(_, p)| p)
+    }
+}
+
+/// Find all properties for a given graph starting with a specific input value. The input is
+/// given as the index of a vertex in the first stage, and the properties are left in
+/// `frontier`, indexed by the index of the output vertex in the last stage. If `bounds` are
+/// given, partial properties which can't reach the threshold are dropped along the way.
 fn find_properties(
     cipher: &dyn Cipher,
-    graph: &MultistageGraph,
+    graph: &FrozenGraph,
     property_type: PropertyType,
-    input: u128,
-) -> IndexMap<u128, Property> {
-    let start_property = Property::new(input, input, 1.0, 1);
-
-    // The edge map maps output values to properties over a number of rounds
+    bounds: Option<&Bounds>,
+    input: usize,
+    frontier: &mut Frontier,
+) {
+    // The frontier maps output values to properties over a number of rounds
     // It first contains an "empty" property
-    let mut edge_map = IndexMap::new();
-    edge_map.insert(input, start_property);
+    frontier.start(graph, input);
+    prune_rows(bounds, std::slice::from_mut(&mut frontier.current), 0, true);
 
-    // Extend the edge map the desired number of rounds
+    // Extend the frontier the desired number of rounds
     for r in 0..graph.stages() {
-        let mut new_edge_map = IndexMap::new();
-
-        // Go through all edges (i.e. properties (input, output)) in the current map
-        for (output, &property) in &edge_map {
-            // Look up output in the single round map in order to extend one round
-            if let Some(inputs) = graph.forward_edges().get(output) {
-                for (&new_output, &(stages, length)) in inputs.iter() {
-                    if ((stages >> r) & 0x1) != 1 {
-                        continue;
-                    }
+        frontier.extend(graph.forward_edges(r), graph.vertices(r + 1), property_type);
+        prune_rows(
+            bounds,
+            std::slice::from_mut(&mut frontier.current),
+            r + 1,
+            true,
+        );
+    }
+
+    // In case of Prince type cipher, go back through the graph as well
+    if cipher.structure() == CipherStructure::Prince {
+        let stages = graph.stages();
 
-                    // Either add the new path to the current property or create a new one
-                    let new_value = match property_type {
-                        PropertyType::Linear => length,
-                        PropertyType::Differential => length,
-                    };
+        // First apply reflection layer
+        reflect_row(cipher, graph, &mut frontier.current);
+        prune_rows(
+            bounds,
+            std::slice::from_mut(&mut frontier.current),
+            stages,
+            false,
+        );
+
+        // Extend the frontier the desired number of rounds backwards
+        for r in 0..stages {
+            let stage = stages - 1 - r;
+            frontier.extend(
+                graph.backward_edges(stage),
+                graph.vertices(stage),
+                property_type,
+            );
+            prune_rows(
+                bounds,
+                std::slice::from_mut(&mut frontier.current),
+                stage,
+                false,
+            );
+        }
+    }
+}
+
+/// Upper bounds on the value a partial property can still gain before the search ends. The
+/// bound of a vertex is the summed value of all paths from the vertex to the end of the search,
+/// so a frontier entry whose value times the bound of its vertex is below the threshold adds
+/// less than the threshold to any property. Such entries are dropped, at the cost of slightly
+/// underestimating properties which gain from many of them.
+struct Bounds {
+    threshold: f64,
+    forward: Vec<Vec<f64>>,
+    backward: Vec<Vec<f64>>,
+}
+
+impl Bounds {
+    /// Computes the bounds of all vertices of a graph by a single pass from the end of the
+    /// search back to the first stage. For Prince-like ciphers, `backward` holds the bounds of
+    /// vertices reached after the reflection layer.
+    fn new(cipher: &dyn Cipher, graph: &FrozenGraph, threshold: f64) -> Bounds {
+        let stages = graph.stages();
+
+        // Sums the bounds of the heads of each tail, weighted by edge lengths
+        let sum = |edges: &Adjacency, next: &[f64]| -> Vec<f64> {
+            (0..edges.num_sources())
+                .map(|tail| {
+                    edges
+                        .edges(tail)
+                        .map(|(head, length)| length * next[head])
+                        .sum()
+                })
+                .collect()
+        };
+
+        let mut backward = Vec::new();
+        let last = if cipher.structure() == CipherStructure::Prince {
+            backward.push(vec![1.0; graph.num_vertices(0)]);
+
+            for stage in 0..stages {
+                let next = sum(&graph.load_backward_edges(stage), &backward[stage]);
+                backward.push(next);
+            }
+
+            graph
+                .vertices(stages)
+                .iter()
+                .map(|&vertex| {
+                    graph
+                        .vertex_index(cipher.reflection_layer(vertex), stages)
+                        .map_or(0.0, |reflected| backward[stages][reflected])
+                })
+                .collect()
+        } else {
+            vec![1.0; graph.num_vertices(stages)]
+        };
+
+        let mut forward = vec![last];
+
+        for stage in (0..stages).rev() {
+            let next = sum(&graph.load_forward_edges(stage), &forward[0]);
+            forward.insert(0, next);
+        }
+
+        Bounds {
+            threshold,
+            forward,
+            backward,
+        }
+    }
+
+    /// Returns the bounds of the vertices of a stage. `forward` selects whether the stage is
+    /// reached before or after the reflection layer.
+    fn stage(&self, stage: usize, forward: bool) -> &[f64] {
+        if forward {
+            &self.forward[stage]
+        } else {
+            &self.backward[stage]
+        }
+    }
+}
+
+/// Drop the entries of sparse rows which can't add at least the threshold to any property.
+fn prune_rows(bounds: Option<&Bounds>, rows: &mut [SparseRow], stage: usize, forward: bool) {
+    if let Some(bounds) = bounds {
+        let stage_bounds = bounds.stage(stage, forward);
 
-                    let entry = new_edge_map
-                        .entry(new_output as u128)
-                        .or_insert(Property::new(property.input, new_output as u128, 0.0, 0));
+        for row in rows.iter_mut() {
+            row.retain(|&(k, p)| p.value * stage_bounds[k as usize] >= bounds.threshold);
+        }
+    }
+}
+
+/// A property ordered by value in reverse, such that a `BinaryHeap` of them keeps the property
+/// with the smallest value on top.
+struct Ranked(Property);
+
+impl PartialEq for Ranked {
+    fn eq(&self, other: &Ranked) -> bool {
+        self.0.value == other.0.value
+    }
+}
+
+impl Eq for Ranked {}
+
+impl PartialOrd for Ranked {
+    fn partial_cmp(&self, other: &Ranked) -> Option<Ordering> {
+        Some(self.cmp(other))
+    }
+}
+
+impl Ord for Ranked {
+    fn cmp(&self, other: &Ranked) -> Ordering {
+        other.0.value.partial_cmp(&self.0.value).unwrap()
+    }
+}
+
+/// The number of properties to keep, together with a lower bound on the value of the best
+/// `num_keep` properties found by all threads. The bound is raised whenever a thread has found
+/// `num_keep` properties, and any property below it can be discarded straight away.
+struct Cutoff {
+    num_keep: usize,
+    value: AtomicU64,
+}
+
+impl Cutoff {
+    /// Creates a cut-off for keeping `num_keep` properties, which initially discards
+    /// properties with a value below `threshold`.
+    fn new(num_keep: usize, threshold: f64) -> Cutoff {
+        Cutoff {
+            num_keep,
+            value: AtomicU64::new(threshold.to_bits()),
+        }
+    }
+
+    /// Returns the current cut-off value.
+    fn get(&self) -> f64 {
+        f64::from_bits(self.value.load(AtomicOrdering::Relaxed))
+    }
+
+    /// Raise the cut-off value to `value` if it is currently lower.
+    fn raise(&self, value: f64) {
+        let mut current = self.value.load(AtomicOrdering::Relaxed);
 
-                    (*entry).trails += property.trails;
-                    (*entry).value += property.value * new_value;
+        while f64::from_bits(current) < value {
+            match self.value.compare_exchange_weak(
+                current,
+                value.to_bits(),
+                AtomicOrdering::Relaxed,
+                AtomicOrdering::Relaxed,
+            ) {
+                Ok(_) => break,
+                Err(actual) => current = actual,
+            }
+        }
+    }
+}
+
+/// Optional destinations for the allowed properties found, besides the best properties.
+#[derive(Clone, Copy)]
+struct Sinks<'a> {
+    export: Option<&'a Export>,
+    aggregation: Option<&'a Aggregation>,
+}
+
+/// The properties found by a single thread.
+struct ThreadResult {
+    result: BinaryHeap<Ranked>,
+    min_value: f64,
+    num_found: usize,
+    paths: u128,
+    export: Option<ExportWriter>,
+    aggregation: Option<LocalAggregation>,
+}
+
+impl ThreadResult {
+    /// Creates an empty result. If an export is given, the thread streams properties to its own
+    /// export file, and if an aggregation is given, it accumulates its own sums.
+    fn new(sinks: Sinks) -> ThreadResult {
+        ThreadResult {
+            result: BinaryHeap::new(),
+            min_value: 1.0_f64,
+            num_found: 0,
+            paths: 0,
+            export: sinks.export.map(Export::writer),
+            aggregation: sinks.aggregation.map(Aggregation::local),
+        }
+    }
+
+    /// Add the properties found for a single input, keeping only the best `cutoff.num_keep`.
+    /// Allowed properties are also written to the export file and added to the aggregated sums,
+    /// if any.
+    fn add<'a, I>(&mut self, properties: I, allowed: &FnvHashSet<(u128, u128)>, cutoff: &Cutoff)
+    where
+        I: ExactSizeIterator<Item = &'a Property>,
+    {
+        self.num_found += properties.len();
+        let mut threshold = cutoff.get();
+
+        for property in properties {
+            if !allowed.is_empty() && !allowed.contains(&(property.input, property.output)) {
+                continue;
+            }
+
+            self.paths += property.trails;
+            self.min_value = self.min_value.min(property.value);
+
+            if let Some(export) = &mut self.export {
+                export.write(property);
+            }
+
+            if let Some(aggregation) = &mut self.aggregation {
+                aggregation.add(property);
+            }
+
+            // Only keep best <num_keep> properties
+            if property.value < threshold || cutoff.num_keep == 0 {
+                continue;
+            }
+
+            if self.result.len() < cutoff.num_keep {
+                self.result.push(Ranked(*property));
+            } else if self
+                .result
+                .peek()
+                .map_or(false, |worst| property.value > worst.0.value)
+            {
+                self.result.pop();
+                self.result.push(Ranked(*property));
+            } else {
+                continue;
+            }
+
+            if self.result.len() == cutoff.num_keep {
+                let worst = self.result.peek().unwrap().0.value;
+
+                if worst > threshold {
+                    cutoff.raise(worst);
+                    threshold = cutoff.get();
                 }
             }
         }
+    }
+}
+
+/// Hands out tasks to threads on demand, in order of decreasing estimated cost. Starting the
+/// most expensive tasks first means threads finish at roughly the same time, even when the cost
+/// of tasks varies a lot.
+struct Scheduler {
+    order: Vec<usize>,
+    next: AtomicUsize,
+    done: AtomicUsize,
+}
+
+impl Scheduler {
+    /// Creates a scheduler for tasks with the given estimated costs.
+    fn new(costs: &[usize]) -> Scheduler {
+        let mut order: Vec<_> = (0..costs.len()).collect();
+        order.sort_by_key(|&task| Reverse(costs[task]));
+
+        Scheduler {
+            order,
+            next: AtomicUsize::new(0),
+            done: AtomicUsize::new(0),
+        }
+    }
 
-        edge_map = new_edge_map;
+    /// Returns the number of tasks.
+    fn len(&self) -> usize {
+        self.order.len()
     }
 
-    // In case of Prince type cipher, go back through the graph as well
-    if cipher.structure() == CipherStructure::Prince {
-        // First apply reflection layer
-        edge_map = edge_map
+    /// Returns the next task to run, if any are left.
+    fn next(&self) -> Option<usize> {
+        let i = self.next.fetch_add(1, AtomicOrdering::Relaxed);
+        self.order.get(i).cloned()
+    }
+
+    /// Marks a task as finished and returns the number of tasks finished so far.
+    fn finish(&self) -> usize {
+        self.done.fetch_add(1, AtomicOrdering::Relaxed) + 1
+    }
+}
+
+/// Estimates the cost of finding the properties of each of `sources` for a graph held in
+/// memory, as the number of paths of length two starting from the input.
+fn input_costs(graph: &FrozenGraph, sources: &[usize]) -> Vec<usize> {
+    let first = graph.forward_edges(0);
+
+    sources
+        .iter()
+        .map(|&input| {
+            if graph.stages() < 2 {
+                return first.degree(input);
+            }
+
+            let second = graph.forward_edges(1);
+            first
+                .edges(input)
+                .map(|(vertex, _)| second.degree(vertex).max(1))
+                .sum()
+        })
+        .collect()
+}
+
+/// Find all properties for a graph held in memory. Threads take input values to search from
+/// until none are left, starting with the most expensive ones.
+fn memory_find_properties(
+    cipher: &dyn Cipher,
+    graph: &FrozenGraph,
+    property_type: PropertyType,
+    allowed: &FnvHashSet<(u128, u128)>,
+    sources: &[usize],
+    cutoff: &Cutoff,
+    bounds: Option<&Bounds>,
+    sinks: Sinks,
+) -> Vec<ThreadResult> {
+    let scheduler = Scheduler::new(&input_costs(graph, sources));
+    let scheduler = &scheduler;
+    let (result_tx, result_rx) = mpsc::channel();
+
+    // Start scoped worker threads
+    crossbeam_utils::thread::scope(|scope| {
+        for t in 0..*THREADS {
+            let result_tx = result_tx.clone();
+
+            scope.spawn(move |_| {
+                let mut progress_bar = ProgressBar::new(scheduler.len());
+                let mut progress = 0;
+                let mut thread_result = ThreadResult::new(sinks);
+                let mut frontier = Frontier::new(graph);
+
+                // Take input values from the scheduler and call find_properties
+                while let Some(task) = scheduler.next() {
+                    let input = sources[task];
+                    find_properties(cipher, graph, property_type, bounds, input, &mut frontier);
+                    thread_result.add(frontier.properties(), allowed, cutoff);
+                    let done = scheduler.finish();
+
+                    while t == 0 && progress < done {
+                        progress_bar.increment();
+                        progress += 1;
+                    }
+                }
+
+                result_tx
+                    .send(thread_result)
+                    .expect("Thread could not send result");
+            });
+        }
+    })
+    .expect("Threads failed to join.");
+
+    (0..*THREADS)
+        .map(|_| result_rx.recv().expect("Main could not receive result"))
+        .collect()
+}
+
+/// Find all properties for a graph whose edges are spilled to disk. Inputs are processed in
+/// batches, and the stages are read from disk one at a time for each batch, so only the rows of
+/// a single batch are kept in memory. The first batch assumes rows as wide as the widest stage,
+/// and later batches are sized from the rows seen so far, to keep the rows within `budget`
+/// bytes. All threads multiply their share of the rows of a batch by the matrix of each stage.
+fn streamed_find_properties(
+    cipher: &dyn Cipher,
+    graph: &FrozenGraph,
+    property_type: PropertyType,
+    allowed: &FnvHashSet<(u128, u128)>,
+    sources: &[usize],
+    cutoff: &Cutoff,
+    bounds: Option<&Bounds>,
+    sinks: Sinks,
+    budget: f64,
+) -> Vec<ThreadResult> {
+    let stages = graph.stages();
+    let prince = cipher.structure() == CipherStructure::Prince;
+    let mut thread_results: Vec<_> = (0..*THREADS).map(|_| ThreadResult::new(sinks)).collect();
+    let mut positions = vec![Vec::new(); *THREADS];
+    let mut progress_bar = ProgressBar::new(sources.len());
+
+    // While multiplying, both a row and its product hold at most one entry per vertex
+    let entry_bytes = 2 * std::mem::size_of::<(u32, Property)>();
+    let widest = (0..=stages).map(|stage| graph.num_vertices(stage)).max();
+    let mut row_bytes = widest.unwrap_or(1).max(1) * entry_bytes;
+    let mut observed_bytes = 0;
+    let mut batch_start = 0;
+
+    while batch_start < sources.len() {
+        let batch_size = ((budget / row_bytes as f64) as usize).max(1);
+        let batch_end = sources.len().min(batch_start + batch_size);
+        let mut spares = vec![Vec::new(); *THREADS];
+        let mut peak_entries = 0;
+
+        let mut rows: Vec<_> = sources[batch_start..batch_end]
             .iter()
-            .map(|(&k, &v)| (cipher.reflection_layer(k), v))
+            .map(|&input| start_row(graph, input, Vec::new()))
             .collect();
+        prune_rows(bounds, &mut rows, 0, true);
+        let chunk_size = std::cmp::max(1, (rows.len() + *THREADS - 1) / *THREADS);
 
-        // Extend the edge map the desired number of rounds backwards
-        for r in 0..graph.stages() {
-            let mut new_edge_map = IndexMap::new();
-
-            // Go through all backward edges (i.e. properties (input, output)) in the current map
-            for (output, &property) in &edge_map {
-                // Look up output in the single round map in order to extend one round
-                if let Some(inputs) = graph.backward_edges().get(output) {
-                    for (&new_output, &(stages, length)) in inputs.iter() {
-                        if ((stages >> (graph.stages() - 1 - r)) & 0x1) != 1 {
-                            continue;
-                        }
+        // Multiply all rows by the matrix of one stage, forwards if `forward` is set and
+        // backwards otherwise
+        let mut multiply = |rows: &mut Vec<SparseRow>, stage: usize, forward: bool| {
+            let (edges, outputs, next) = if forward {
+                (
+                    graph.load_forward_edges(stage),
+                    graph.vertices(stage + 1),
+                    stage + 1,
+                )
+            } else {
+                (
+                    graph.load_backward_edges(stage),
+                    graph.vertices(stage),
+                    stage,
+                )
+            };
+            let edges = &edges;
 
-                        // Either add the new path to the current property or create a new one
-                        let new_value = match property_type {
-                            PropertyType::Linear => length,
-                            PropertyType::Differential => length,
-                        };
+            crossbeam_utils::thread::scope(|scope| {
+                let buffers = positions.iter_mut().zip(spares.iter_mut());
+
+                for (chunk, (position, spare)) in rows.chunks_mut(chunk_size).zip(buffers) {
+                    scope.spawn(move |_| {
+                        multiply_rows(chunk, spare, edges, outputs, property_type, position);
+                        prune_rows(bounds, chunk, next, forward);
+                    });
+                }
+            })
+            .expect("Threads failed to join.");
 
-                        let entry = new_edge_map
-                            .entry(new_output as u128)
-                            .or_insert(Property::new(property.input, new_output as u128, 0.0, 0));
+            let entries: usize = rows.iter().map(Vec::len).sum();
+            peak_entries = peak_entries.max(entries);
+        };
 
-                        (*entry).trails += property.trails;
-                        (*entry).value += property.value * new_value;
+        for stage in 0..stages {
+            multiply(&mut rows, stage, true);
+        }
+
+        // In case of Prince type cipher, go back through the graph as well
+        if prince {
+            for row in rows.iter_mut() {
+                reflect_row(cipher, graph, row);
+            }
+
+            prune_rows(bounds, &mut rows, stages, false);
+
+            for stage in (0..stages).rev() {
+                multiply(&mut rows, stage, false);
+            }
+        }
+
+        crossbeam_utils::thread::scope(|scope| {
+            for (chunk, thread_result) in rows.chunks(chunk_size).zip(thread_results.iter_mut()) {
+                scope.spawn(move |_| {
+                    for row in chunk {
+                        thread_result.add(row.iter().map(|(_, p)| p), allowed, cutoff);
                     }
-                }
+                });
             }
+        })
+        .expect("Threads failed to join.");
 
-            edge_map = new_edge_map;
+        // Size the next batch by the widest rows per input seen so far
+        let inputs = batch_end - batch_start;
+        let bytes = (peak_entries * entry_bytes + inputs - 1) / inputs;
+        observed_bytes = observed_bytes.max(bytes);
+        row_bytes = observed_bytes.max(entry_bytes);
+
+        for _ in 0..inputs {
+            progress_bar.increment();
         }
+
+        batch_start = batch_end;
     }
 
-    edge_map
+    thread_results
 }
 
-/// Find all properties for a given graph in a parallelised way.
-///
-/// # Parameters
-/// * `cipher`: The cipher we are analysing.
-/// * `graph`: A graph generated with `generate_graph`.
-/// * `property_type': The type of property the graph represents.
-/// * `allowed`: A set of allowed input-output pairs. Properties not matching these are filtered.
-/// * `num_keep`: Only the best `num_keep` properties are returned.
-pub fn parallel_find_properties(
-    cipher: &dyn Cipher,
-    graph: &MultistageGraph,
+/// Find the properties of the allowed input-output pairs of a graph held in memory by meeting in
+/// the middle. Rows are propagated forwards from each allowed input and backwards from each
+/// allowed output to a middle stage, and each allowed pair is found by joining the two rows on
+/// the middle vertices. Only applies to ciphers which aren't Prince-like, and requires the
+/// backward edges of the graph.
+fn meet_find_properties(
+    graph: &FrozenGraph,
     property_type: PropertyType,
     allowed: &FnvHashSet<(u128, u128)>,
-    num_keep: usize,
-) -> (Vec<Property>, f64, u128) {
-    println!(
-        "Finding properties ({} input values, {} edges):",
-        graph.num_vertices(0),
-        graph.num_edges()
-    );
+    cutoff: &Cutoff,
+    sinks: Sinks,
+) -> Vec<ThreadResult> {
+    let stages = graph.stages();
+    let middle = stages / 2;
 
-    let start = Instant::now();
+    // Group allowed outputs by input, and number the distinct outputs
+    let mut pairs: FnvHashMap<usize, Vec<usize>> = FnvHashMap::default();
+    let mut outputs = IndexSet::new();
+
+    for &(input, output) in allowed {
+        if let (Some(input), Some(output)) = (
+            graph.vertex_index(input, 0),
+            graph.vertex_index(output, stages),
+        ) {
+            let (output, _) = outputs.insert_full(output);
+            pairs.entry(input).or_insert_with(Vec::new).push(output);
+        }
+    }
+
+    // Propagate each output backwards to the middle stage
+    let scheduler = Scheduler::new(&vec![1; outputs.len()]);
+    let scheduler = &scheduler;
+    let outputs = &outputs;
+    let mut backward: Vec<SparseRow> = vec![Vec::new(); outputs.len()];
+
+    crossbeam_utils::thread::scope(|scope| {
+        let handles: Vec<_> = (0..*THREADS)
+            .map(|_| {
+                scope.spawn(move |_| {
+                    let mut rows = Vec::new();
+                    let mut position = Vec::new();
+                    let mut spare = Vec::new();
+
+                    while let Some(i) = scheduler.next() {
+                        let output = outputs[i];
+                        let label = graph.vertices(stages)[output];
+                        let mut row = vec![(output as u32, Property::new(label, label, 1.0, 1))];
+
+                        for stage in (middle..stages).rev() {
+                            multiply_rows(
+                                std::slice::from_mut(&mut row),
+                                &mut spare,
+                                graph.backward_edges(stage),
+                                graph.vertices(stage),
+                                property_type,
+                                &mut position,
+                            );
+                        }
+
+                        rows.push((i, row));
+                    }
+
+                    rows
+                })
+            })
+            .collect();
+
+        for handle in handles {
+            for (i, row) in handle.join().expect("Thread failed to join.") {
+                backward[i] = row;
+            }
+        }
+    })
+    .expect("Threads failed to join.");
+
+    // Propagate each input forwards to the middle stage and join with the outputs
+    let inputs: Vec<_> = pairs.keys().cloned().collect();
+    let costs: Vec<_> = inputs.iter().map(|input| pairs[input].len()).collect();
+    let scheduler = Scheduler::new(&costs);
+    let scheduler = &scheduler;
+    let (inputs, pairs, backward) = (&inputs, &pairs, &backward);
     let (result_tx, result_rx) = mpsc::channel();
 
-    // Start scoped worker threads
     crossbeam_utils::thread::scope(|scope| {
         for t in 0..*THREADS {
             let result_tx = result_tx.clone();
 
             scope.spawn(move |_| {
-                let mut progress_bar =
-                    ProgressBar::new((0..graph.num_vertices(0)).skip(t).step_by(*THREADS).len());
-                let mut result = vec![];
-                let mut min_value = 1.0_f64;
-                let mut num_found = 0;
-                let mut paths = 0;
-
-                // Split input values between threads and call find_properties
-                for &input in graph
-                    .get_vertices_outgoing(0)
-                    .iter()
-                    .skip(t)
-                    .step_by(*THREADS)
-                {
-                    let properties = find_properties(cipher, &graph, property_type, input as u128);
-                    num_found += properties.len();
-
-                    for property in properties.values() {
-                        if allowed.is_empty()
-                            || allowed.contains(&(property.input, property.output))
-                        {
-                            paths += property.trails;
-                            result.push(*property);
+                let mut progress_bar = ProgressBar::new(scheduler.len());
+                let mut progress = 0;
+                let mut thread_result = ThreadResult::new(sinks);
+                let mut frontier = Frontier::new(graph);
+                let mut middle_row = vec![None; graph.num_vertices(middle)];
+
+                while let Some(i) = scheduler.next() {
+                    let input = inputs[i];
+                    frontier.start(graph, input);
+
+                    for stage in 0..middle {
+                        frontier.extend(
+                            graph.forward_edges(stage),
+                            graph.vertices(stage + 1),
+                            property_type,
+                        );
+                    }
+
+                    for &(vertex, property) in &frontier.current {
+                        middle_row[vertex as usize] = Some(property);
+                    }
+
+                    let properties: Vec<_> = pairs[&input]
+                        .iter()
+                        .filter_map(|&i| {
+                            let mut property = Property::new(
+                                graph.vertices(0)[input],
+                                graph.vertices(stages)[outputs[i]],
+                                0.0,
+                                0,
+                            );
+
+                            for &(vertex, tail) in &backward[i] {
+                                if let Some(head) = middle_row[vertex as usize] {
+                                    property.trails += head.trails * tail.trails;
+                                    property.value += head.value * tail.value;
+                                }
+                            }
+
+                            if property.trails > 0 {
+                                Some(property)
+                            } else {
+                                None
+                            }
+                        })
+                        .collect();
+
+                    for &(vertex, _) in &frontier.current {
+                        middle_row[vertex as usize] = None;
+                    }
+
+                    thread_result.add(properties.iter(), allowed, cutoff);
+                    let done = scheduler.finish();
+
+                    while t == 0 && progress < done {
+                        progress_bar.increment();
+                        progress += 1;
+                    }
+                }
+
+                result_tx
+                    .send(thread_result)
+                    .expect("Thread could not send result");
+            });
+        }
+    })
+    .expect("Threads failed to join.");
+
+    (0..*THREADS)
+        .map(|_| result_rx.recv().expect("Main could not receive result"))
+        .collect()
+}
+
+/// Find all properties for a Prince-like cipher held in memory by combining hulls over the
+/// forward half of the graph. The backward half of a path from an output is the forward half of
+/// a path from that output read in reverse, so the forward hulls of all vertices of the first
+/// stage are computed once, as a table `H`, and the properties are then given by `H P H^T`,
+/// where `P` is the reflection layer. The properties are exact, so a threshold is only applied
+/// to the final values through `cutoff`, and no bounds or backward edges are needed.
+fn reflect_find_properties(
+    cipher: &dyn Cipher,
+    graph: &FrozenGraph,
+    property_type: PropertyType,
+    allowed: &FnvHashSet<(u128, u128)>,
+    sources: &[usize],
+    cutoff: &Cutoff,
+    sinks: Sinks,
+) -> Vec<ThreadResult> {
+    let stages = graph.stages();
+    let num_inputs = graph.num_vertices(0);
+    let num_outputs = graph.num_vertices(stages);
+
+    // Compute the forward hulls of all vertices in the first stage
+    let all: Vec<_> = (0..num_inputs).collect();
+    let scheduler = Scheduler::new(&input_costs(graph, &all));
+    let scheduler = &scheduler;
+    let mut table: Vec<SparseRow> = vec![Vec::new(); num_inputs];
+
+    crossbeam_utils::thread::scope(|scope| {
+        let handles: Vec<_> = (0..*THREADS)
+            .map(|_| {
+                scope.spawn(move |_| {
+                    let mut frontier = Frontier::new(graph);
+                    let mut rows = Vec::new();
+
+                    while let Some(input) = scheduler.next() {
+                        frontier.start(graph, input);
+
+                        for stage in 0..stages {
+                            frontier.extend(
+                                graph.forward_edges(stage),
+                                graph.vertices(stage + 1),
+                                property_type,
+                            );
                         }
+
+                        rows.push((input, frontier.current.clone()));
                     }
 
-                    // Only keep best <num_keep> properties
-                    result.sort_by(|a, b| b.value.partial_cmp(&a.value).unwrap());
+                    rows
+                })
+            })
+            .collect();
+
+        for handle in handles {
+            for (input, row) in handle.join().expect("Thread failed to join.") {
+                table[input] = row;
+            }
+        }
+    })
+    .expect("Threads failed to join.");
+
+    // Index the table by last stage vertex, applying the reflection layer on the way
+    let reflected: Vec<_> = graph
+        .vertices(stages)
+        .iter()
+        .map(|&vertex| graph.vertex_index(cipher.reflection_layer(vertex), stages))
+        .collect();
+    let mut offsets = vec![0; num_outputs + 1];
+
+    for row in &table {
+        for &(vertex, _) in row {
+            offsets[vertex as usize + 1] += 1;
+        }
+    }
+
+    for i in 0..num_outputs {
+        offsets[i + 1] += offsets[i];
+    }
+
+    let mut next = offsets.clone();
+    let mut transposed = vec![(0, Property::new(0, 0, 0.0, 0)); offsets[num_outputs]];
+
+    for (output, row) in table.iter().enumerate() {
+        for &(vertex, property) in row {
+            transposed[next[vertex as usize]] = (output as u32, property);
+            next[vertex as usize] += 1;
+        }
+    }
+
+    // Combine the forward hull of each input with the transposed table through the reflection
+    let costs: Vec<_> = sources.iter().map(|&input| table[input].len()).collect();
+    let scheduler = Scheduler::new(&costs);
+    let scheduler = &scheduler;
+    let (table, reflected) = (&table, &reflected);
+    let (offsets, transposed) = (&offsets, &transposed);
+    let (result_tx, result_rx) = mpsc::channel();
+
+    crossbeam_utils::thread::scope(|scope| {
+        for t in 0..*THREADS {
+            let result_tx = result_tx.clone();
+
+            scope.spawn(move |_| {
+                let mut progress_bar = ProgressBar::new(scheduler.len());
+                let mut progress = 0;
+                let mut thread_result = ThreadResult::new(sinks);
+                let mut position = vec![NO_ENTRY; num_inputs];
+                let mut properties: Vec<Property> = Vec::new();
+                let mut touched = Vec::new();
+
+                while let Some(task) = scheduler.next() {
+                    let input = sources[task];
+                    let input_label = graph.vertices(0)[input];
+                    properties.clear();
+                    touched.clear();
+
+                    for &(vertex, head) in &table[input] {
+                        let w = match reflected[vertex as usize] {
+                            Some(w) => w,
+                            None => continue,
+                        };
+
+                        for &(output, tail) in &transposed[offsets[w]..offsets[w + 1]] {
+                            let output = output as usize;
+
+                            if position[output] == NO_ENTRY {
+                                position[output] = properties.len() as u32;
+                                touched.push(output);
+                                properties.push(Property::new(
+                                    input_label,
+                                    graph.vertices(0)[output],
+                                    0.0,
+                                    0,
+                                ));
+                            }
+
+                            let entry = &mut properties[position[output] as usize];
+                            entry.trails += head.trails * tail.trails;
+                            entry.value += head.value * tail.value;
+                        }
+                    }
 
-                    if let Some(property) = result.last() {
-                        min_value = min_value.min(property.value);
+                    for &output in &touched {
+                        position[output] = NO_ENTRY;
                     }
 
-                    result.truncate(num_keep);
+                    thread_result.add(properties.iter(), allowed, cutoff);
+                    let done = scheduler.finish();
 
-                    if t == 0 {
+                    while t == 0 && progress < done {
                         progress_bar.increment();
+                        progress += 1;
                     }
                 }
 
                 result_tx
-                    .send((result, min_value, num_found, paths))
+                    .send(thread_result)
                     .expect("Thread could not send result");
             });
         }
     })
     .expect("Threads failed to join.");
 
+    (0..*THREADS)
+        .map(|_| result_rx.recv().expect("Main could not receive result"))
+        .collect()
+}
+
+/// Options selecting how properties are found, and where the allowed properties are streamed
+/// to besides the best properties. The default searches from each input in memory.
+#[derive(Clone, Copy, Default)]
+pub struct FindOptions<'a> {
+    /// Only evaluate the allowed pairs by meeting in the middle of the graph. Ignored unless
+    /// `allowed` is non-empty and the graph is held in memory with backward edges.
+    pub meet_in_middle: bool,
+    /// For Prince-like ciphers, combine hulls over the forward half of the graph, computed once
+    /// for all vertices of the first stage, rather than traversing the graph twice for each
+    /// input. Ignored if the graph is spilled.
+    pub half_graph: bool,
+    /// If given, only properties with at least this value are returned, and partial properties
+    /// which can't reach it on their own are dropped during the search. The returned values are
+    /// then lower bounds on the actual values. When combining half graph hulls or meeting in the
+    /// middle, nothing is dropped and the returned values are exact.
+    pub threshold: Option<f64>,
+    /// If given, every allowed property above the export value is streamed to files.
+    pub export: Option<&'a Export>,
+    /// If given, the values of all allowed properties are summed in groups.
+    pub aggregation: Option<&'a Aggregation>,
+    /// Memory budget in bytes for the rows of the inputs searched together when the graph is
+    /// spilled. Defaults to 1 GiB.
+    pub max_memory: Option<f64>,
+}
+
+/// Find all properties for a given graph in a parallelised way. If the graph is spilled to
+/// disk, its stages are streamed from disk rather than held in memory.
+///
+/// # Parameters
+/// * `cipher`: The cipher we are analysing.
+/// * `graph`: A graph generated with `generate_graph`.
+/// * `property_type': The type of property the graph represents.
+/// * `allowed`: A set of allowed input-output pairs. Properties not matching these are filtered.
+/// * `num_keep`: Only the best `num_keep` properties are returned.
+/// * `options`: How the properties are found, and where they are streamed to.
+pub fn parallel_find_properties(
+    cipher: &dyn Cipher,
+    graph: &FrozenGraph,
+    property_type: PropertyType,
+    allowed: &FnvHashSet<(u128, u128)>,
+    num_keep: usize,
+    options: &FindOptions,
+) -> (Vec<Property>, f64, u128) {
+    let FindOptions {
+        meet_in_middle,
+        half_graph,
+        threshold,
+        export,
+        aggregation,
+        max_memory,
+    } = *options;
+
+    println!(
+        "Finding properties ({} input values, {} edges):",
+        graph.num_vertices(0),
+        graph.num_edges()
+    );
+
+    let start = Instant::now();
+    let cutoff = Cutoff::new(num_keep, threshold.unwrap_or(0.0));
+    let cutoff = &cutoff;
+    let prince = cipher.structure() == CipherStructure::Prince;
+    let reflect = !graph.is_spilled() && half_graph && prince;
+    let meet = !graph.is_spilled()
+        && !reflect
+        && meet_in_middle
+        && !allowed.is_empty()
+        && graph.has_backward()
+        && !prince;
+
+    // Only the engines which propagate rows from each input use bounds
+    let bounds = if reflect || meet {
+        None
+    } else {
+        threshold.map(|threshold| Bounds::new(cipher, graph, threshold))
+    };
+    let bounds = bounds.as_ref();
+
+    // Only inputs of allowed pairs need to be searched from
+    let sources: Vec<_> = if allowed.is_empty() {
+        (0..graph.num_vertices(0)).collect()
+    } else {
+        let inputs: FnvHashSet<_> = allowed.iter().map(|&(input, _)| input).collect();
+        (0..graph.num_vertices(0))
+            .filter(|&input| inputs.contains(&graph.vertices(0)[input]))
+            .collect()
+    };
+    let sources = &sources;
+    let sinks = Sinks {
+        export,
+        aggregation,
+    };
+    let thread_results = if graph.is_spilled() {
+        streamed_find_properties(
+            cipher,
+            graph,
+            property_type,
+            allowed,
+            sources,
+            cutoff,
+            bounds,
+            sinks,
+            max_memory.unwrap_or(STREAM_BUDGET),
+        )
+    } else if reflect {
+        reflect_find_properties(
+            cipher,
+            graph,
+            property_type,
+            allowed,
+            sources,
+            cutoff,
+            sinks,
+        )
+    } else if meet {
+        meet_find_properties(graph, property_type, allowed, cutoff, sinks)
+    } else {
+        memory_find_properties(
+            cipher,
+            graph,
+            property_type,
+            allowed,
+            sources,
+            cutoff,
+            bounds,
+            sinks,
+        )
+    };
+
     // Collect results from all threads
     let mut paths = 0;
     let mut num_found = 0;
     let mut min_value = 1.0_f64;
+    let mut num_exported = 0;
     let mut result = vec![];
 
-    for _ in 0..*THREADS {
-        let mut thread_result = result_rx.recv().expect("Main could not receive result");
+    for thread_result in thread_results {
+        if let Some(export) = thread_result.export {
+            num_exported += export.finish();
+        }
+
+        if let (Some(aggregation), Some(local)) = (aggregation, thread_result.aggregation) {
+            aggregation.merge(local);
+        }
 
-        result.append(&mut thread_result.0);
-        min_value = min_value.min(thread_result.1);
-        num_found += thread_result.2;
-        paths += thread_result.3;
+        result.extend(thread_result.result.into_iter().map(|ranked| ranked.0));
+        min_value = min_value.min(thread_result.min_value);
+        num_found += thread_result.num_found;
+        paths += thread_result.paths;
     }
 
     result.sort_by(|a, b| b.value.partial_cmp(&a.value).unwrap());
@@ -210,5 +1203,291 @@ pub fn parallel_find_properties(
         start.elapsed().as_secs()
     );
 
+    if let Some(export) = export {
+        println!(
+            "Exported {} properties to {}.*",
+            num_exported,
+            export.prefix()
+        );
+    }
+
     (result, min_value, paths)
 }
+
+#[cfg(test)]
+mod tests {
+    use super::{parallel_find_properties, FindOptions};
+    use crate::cipher::name_to_cipher;
+    use crate::property::PropertyType;
+    use crate::search::graph::MultistageGraph;
+    use crate::search::graph_frozen::FrozenGraph;
+    use fnv::FnvHashSet;
+
+    #[test]
+    fn streamed_batches_match_search() {
+        let cipher = name_to_cipher("present").unwrap();
+        let mut graph = MultistageGraph::new(3);
+
+        for i in 0..200 {
+            graph.add_edges(i % 50, 100 + i % 17, 0b001, 0.5);
+            graph.add_edges(100 + i % 17, 200 + i % 23, 0b010, 0.25);
+            graph.add_edges(200 + i % 23, 300 + i % 11, 0b100, 0.125);
+        }
+
+        let memory = FrozenGraph::new(&graph);
+        let directory =
+            std::env::temp_dir().join(format!("cryptagraph-stream-test-{}", std::process::id()));
+        let mut spilled = FrozenGraph::new(&graph);
+        spilled.spill(directory.to_str().unwrap());
+
+        let allowed = FnvHashSet::default();
+        let (a, min_a, paths_a) = parallel_find_properties(
+            cipher.as_ref(),
+            &memory,
+            PropertyType::Linear,
+            &allowed,
+            std::usize::MAX,
+            &FindOptions::default(),
+        );
+        // A budget of a single byte searches one input at a time
+        let (b, min_b, paths_b) = parallel_find_properties(
+            cipher.as_ref(),
+            &spilled,
+            PropertyType::Linear,
+            &allowed,
+            std::usize::MAX,
+            &FindOptions {
+                max_memory: Some(1.0),
+                ..FindOptions::default()
+            },
+        );
+
+        assert_eq!(paths_a, paths_b);
+        assert_eq!(min_a, min_b);
+
+        let mut a: Vec<_> = a
+            .iter()
+            .map(|p| (p.input, p.output, p.value, p.trails))
+            .collect();
+        let mut b: Vec<_> = b
+            .iter()
+            .map(|p| (p.input, p.output, p.value, p.trails))
+            .collect();
+        a.sort_by(|x, y| x.partial_cmp(y).unwrap());
+        b.sort_by(|x, y| x.partial_cmp(y).unwrap());
+        assert_eq!(a, b);
+
+        drop(spilled);
+        std::fs::remove_dir(&directory).expect("Spill files were not removed.");
+    }
+
+    #[test]
+    fn kept_properties_are_best() {
+        let cipher = name_to_cipher("present").unwrap();
+        let mut graph = MultistageGraph::new(2);
+
+        for i in 0..500 {
+            let length = 1.0 / (1 + i % 7) as f64;
+            graph.add_edges(i % 40, 100 + i % 31, 0b01, length);
+            graph.add_edges(
+                100 + i % 31,
+                200 + i % 13,
+                0b10,
+                1.0 / (1 + i % 31 % 5) as f64,
+            );
+        }
+
+        let graph = FrozenGraph::new(&graph);
+        let allowed = FnvHashSet::default();
+        let find = |num_keep| {
+            parallel_find_properties(
+                cipher.as_ref(),
+                &graph,
+                PropertyType::Linear,
+                &allowed,
+                num_keep,
+                &FindOptions::default(),
+            )
+        };
+        let (all, min_all, paths_all) = find(std::usize::MAX);
+        let (best, min_best, paths_best) = find(25);
+
+        assert_eq!(best.len(), 25);
+        assert_eq!(min_all, min_best);
+        assert_eq!(paths_all, paths_best);
+
+        for (a, b) in all.iter().zip(best.iter()) {
+            assert_eq!(a.value, b.value);
+        }
+    }
+
+    #[test]
+    fn meet_in_middle_matches_search() {
+        let cipher = name_to_cipher("present").unwrap();
+        let mut graph = MultistageGraph::new(4);
+
+        for i in 0..300 {
+            graph.add_edges(i % 30, 100 + i % 17, 0b0001, 0.5);
+            graph.add_edges(100 + i % 17, 200 + i % 23, 0b0010, 0.25);
+            graph.add_edges(200 + i % 23, 300 + i % 19, 0b0100, 0.125);
+            graph.add_edges(300 + i % 19, 400 + i % 11, 0b1000, 0.5);
+        }
+
+        let mut graph = FrozenGraph::new(&graph);
+        graph.build_backward();
+        let allowed = (0..30)
+            .flat_map(|input| (400..411).map(move |output| (input, output)))
+            .filter(|&(input, output)| (input + output) % 3 == 0)
+            .collect();
+        let find = |meet_in_middle| {
+            parallel_find_properties(
+                cipher.as_ref(),
+                &graph,
+                PropertyType::Linear,
+                &allowed,
+                std::usize::MAX,
+                &FindOptions {
+                    meet_in_middle,
+                    ..FindOptions::default()
+                },
+            )
+        };
+        let (a, min_a, paths_a) = find(false);
+        let (b, min_b, paths_b) = find(true);
+
+        assert_eq!(paths_a, paths_b);
+        assert_eq!(min_a, min_b);
+
+        let mut a: Vec<_> = a
+            .iter()
+            .map(|p| (p.input, p.output, p.value, p.trails))
+            .collect();
+        let mut b: Vec<_> = b
+            .iter()
+            .map(|p| (p.input, p.output, p.value, p.trails))
+            .collect();
+        a.sort_by(|x, y| x.partial_cmp(y).unwrap());
+        b.sort_by(|x, y| x.partial_cmp(y).unwrap());
+        assert!(!a.is_empty());
+        assert_eq!(a, b);
+    }
+
+    #[test]
+    fn threshold_keeps_lower_bounds() {
+        let cipher = name_to_cipher("present").unwrap();
+        let mut graph = MultistageGraph::new(3);
+
+        for i in 0..300 {
+            graph.add_edges(i % 30, 100 + i % 17, 0b001, 1.0 / (1 + i % 17 % 4) as f64);
+            graph.add_edges(100 + i % 17, 200 + i % 23, 0b010, 0.25);
+            graph.add_edges(
+                200 + i % 23,
+                300 + i % 19,
+                0b100,
+                1.0 / (1 + i % 19 % 8) as f64,
+            );
+        }
+
+        let graph = FrozenGraph::new(&graph);
+        let allowed = FnvHashSet::default();
+        let find = |threshold| {
+            parallel_find_properties(
+                cipher.as_ref(),
+                &graph,
+                PropertyType::Linear,
+                &allowed,
+                std::usize::MAX,
+                &FindOptions {
+                    threshold,
+                    ..FindOptions::default()
+                },
+            )
+        };
+        let (all, _, _) = find(None);
+        let (loose, _, _) = find(Some(0.0));
+        let threshold = all[all.len() / 2].value;
+        let (best, _, _) = find(Some(threshold));
+
+        assert_eq!(all.len(), loose.len());
+        assert!(!best.is_empty() && best.len() <= all.len());
+
+        for property in &best {
+            let full = all
+                .iter()
+                .find(|p| p.input == property.input && p.output == property.output)
+                .unwrap();
+            assert!(property.value >= threshold && property.value <= full.value);
+        }
+    }
+
+    #[test]
+    fn reflect_matches_search() {
+        let cipher = name_to_cipher("prince").unwrap();
+        let mut graph = MultistageGraph::new(2);
+        let middle: Vec<u128> = (1..=6).map(|i| i << 4).collect();
+        let reflected: Vec<_> = middle.iter().map(|&x| cipher.reflection_layer(x)).collect();
+
+        for i in 0..120u128 {
+            let length = 1.0 / (1 << (i % 4)) as f64;
+            graph.add_edges(1 + i % 20, 100 + i % 13, 0b01, length);
+
+            for &output in middle.iter().chain(&reflected) {
+                if (i + output) % 3 == 0 {
+                    graph.add_edges(100 + i % 13, output, 0b10, 0.5);
+                }
+            }
+        }
+
+        let half = FrozenGraph::new(&graph);
+        let mut full = FrozenGraph::new(&graph);
+        full.build_backward();
+        let allowed = FnvHashSet::default();
+        let find = |graph, half_graph, threshold| {
+            let (properties, min_value, paths) = parallel_find_properties(
+                cipher.as_ref(),
+                graph,
+                PropertyType::Linear,
+                &allowed,
+                std::usize::MAX,
+                &FindOptions {
+                    half_graph,
+                    threshold,
+                    ..FindOptions::default()
+                },
+            );
+            let mut properties: Vec<_> = properties
+                .iter()
+                .map(|p| (p.input, p.output, p.value, p.trails))
+                .collect();
+            properties.sort_by(|x, y| x.partial_cmp(y).unwrap());
+            (properties, min_value, paths)
+        };
+
+        let (all, min_all, paths_all) = find(&full, false, None);
+        let (reflect, min_reflect, paths_reflect) = find(&half, true, None);
+
+        assert!(!all.is_empty());
+        assert_eq!(all, reflect);
+        assert_eq!(min_all, min_reflect);
+        assert_eq!(paths_all, paths_reflect);
+
+        // The half graph has no backward edges, and the threshold only filters exact values
+        let mut values: Vec<_> = all.iter().map(|p| p.2).collect();
+        values.sort_by(|x, y| x.partial_cmp(y).unwrap());
+        let threshold = values[values.len() / 2];
+        let (best, _, _) = find(&full, false, Some(threshold));
+        let (reflect, _, _) = find(&half, true, Some(threshold));
+        let exact: Vec<_> = all.iter().filter(|p| p.2 >= threshold).cloned().collect();
+
+        assert_eq!(reflect, exact);
+        assert!(!best.is_empty());
+
+        for property in &best {
+            let full = exact
+                .iter()
+                .find(|p| p.0 == property.0 && p.1 == property.1)
+                .unwrap();
+            assert!(property.2 <= full.2);
+        }
+    }
+}
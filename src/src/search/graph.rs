@@ -1,17 +1,257 @@
 //! Types for representing a multistage graph.
 
-use fnv::FnvHashMap;
+use crossbeam_utils;
+use fnv::{FnvHashMap, FnvHashSet, FnvHasher};
+use num_cpus;
+use std::hash::Hasher;
+use std::sync::mpsc;
+
+use crate::search::graph_builder::EdgeShard;
+use crate::search::graph_frozen::FrozenGraph;
+
+// The number of threads used for parallel calls is fixed
+lazy_static! {
+    static ref THREADS: usize = num_cpus::get();
+}
+
+// The number of stripes of a vertex interner
+const INTERNER_STRIPES: usize = 64;
+
+// The number of edges sent at once when merging shards, and the number of batches which can be
+// queued for each thread before the senders block
+const MERGE_BATCH: usize = 1 << 12;
+const MERGE_BOUND: usize = 16;
+
+/// A batch of edges sent to the thread owning their tails, or of stages with incoming edges
+/// sent to the thread owning their heads.
+enum MergeBatch {
+    Edges(Vec<(u32, u32, u64, f64)>),
+    Heads(Vec<(u32, u64)>),
+}
 
 /// Computes the hamming weight of x.
 fn hw(x: u64) -> u64 {
     x.count_ones() as u64
 }
 
-/// A structure describing a directed multistage graph.
+/// Returns the vertices connected to the vertices of a worklist by an edge in the given stage.
+/// The edges are given either by tail or by head, and the worklist is split between threads.
+/// The result may contain duplicates.
+fn expand_worklist(
+    edges: &[FnvHashMap<u32, (u64, f64)>],
+    worklist: &[u32],
+    stage: usize,
+) -> Vec<u32> {
+    let chunk_size = std::cmp::max(1, (worklist.len() + *THREADS - 1) / *THREADS);
+    let mut result = Vec::new();
+
+    crossbeam_utils::thread::scope(|scope| {
+        let handles: Vec<_> = worklist
+            .chunks(chunk_size)
+            .map(|chunk| {
+                scope.spawn(move |_| {
+                    let mut found = Vec::new();
+
+                    for &v in chunk {
+                        for (&w, &(stages, _)) in &edges[v as usize] {
+                            if ((stages >> stage) & 0x1) == 1 {
+                                found.push(w);
+                            }
+                        }
+                    }
+
+                    found
+                })
+            })
+            .collect();
+
+        for handle in handles {
+            result.append(&mut handle.join().expect("Thread failed to join."));
+        }
+    })
+    .expect("Threads failed to join.");
+
+    result
+}
+
+/// Removes the stages of the edges in `edges` that are within `mask` but not set in
+/// `alive(w)`, where `w` is the other vertex of the edge. Edges without any stages left are
+/// removed.
+fn remove_dead_edges<F>(edges: &mut FnvHashMap<u32, (u64, f64)>, mask: u64, alive: F)
+where
+    F: Fn(u32) -> u64,
+{
+    let mut removed = false;
+
+    for (&w, edge) in edges.iter_mut() {
+        edge.0 &= !(mask & !alive(w));
+        removed |= edge.0 == 0;
+    }
+
+    if removed {
+        edges.retain(|_, edge| edge.0 != 0);
+
+        // Release the memory of vertices without edges
+        if edges.is_empty() {
+            *edges = FnvHashMap::default();
+        }
+    }
+}
+
+/// Updates per-stage vertex counts after the stage mask of a vertex changes from `old` to `new`.
+fn update_counts(counts: &mut [usize], old: u64, new: u64) {
+    let mut added = new & !old;
+    let mut removed = old & !new;
+
+    while added != 0 {
+        counts[added.trailing_zeros() as usize] += 1;
+        added &= added - 1;
+    }
+
+    while removed != 0 {
+        counts[removed.trailing_zeros() as usize] -= 1;
+        removed &= removed - 1;
+    }
+}
+
+/// Returns the union of the stages of a set of edges.
+fn stage_mask(edges: &FnvHashMap<u32, (u64, f64)>) -> u64 {
+    edges.values().fold(0, |sum, x| sum | x.0)
+}
+
+/// Returns the stripe of a label in an interner.
+fn stripe_of(label: u128) -> usize {
+    let mut hasher = FnvHasher::default();
+    hasher.write_u128(label);
+    (hasher.finish() % INTERNER_STRIPES as u64) as usize
+}
+
+/// A structure assigning dense 32-bit identifiers to vertex labels. Identifiers are never
+/// reused, even if all edges of the corresponding vertex are removed. The map from labels to
+/// identifiers is split into stripes by the hash of each label, so that new labels can be
+/// interned by several threads at once.
+#[derive(Clone, Debug)]
+pub struct VertexInterner {
+    labels: Vec<u128>,
+    ids: Vec<FnvHashMap<u128, u32>>,
+}
+
+impl Default for VertexInterner {
+    fn default() -> Self {
+        VertexInterner {
+            labels: Vec::new(),
+            ids: vec![FnvHashMap::default(); INTERNER_STRIPES],
+        }
+    }
+}
+
+impl VertexInterner {
+    /// Create a new empty interner.
+    pub fn new() -> VertexInterner {
+        VertexInterner::default()
+    }
+
+    /// Returns the identifier of a label, assigning a new identifier if the label is unknown.
+    ///
+    /// # Panics
+    /// Panics if more than 2^32 - 1 labels are interned.
+    pub fn intern(&mut self, label: u128) -> u32 {
+        let stripe = stripe_of(label);
+
+        if let Some(&id) = self.ids[stripe].get(&label) {
+            return id;
+        }
+
+        if self.labels.len() >= std::u32::MAX as usize {
+            panic!("Too many vertices to intern.");
+        }
+
+        let id = self.labels.len() as u32;
+        self.labels.push(label);
+        self.ids[stripe].insert(label, id);
+
+        id
+    }
+
+    /// Interns a set of new labels in parallel. The labels are given by stripe, and each stripe
+    /// is assigned a contiguous range of identifiers.
+    ///
+    /// # Panics
+    /// Panics if more than 2^32 - 1 labels are interned.
+    fn extend_striped(&mut self, new_labels: Vec<Vec<u128>>) {
+        let mut first = self.labels.len();
+        let total = first + new_labels.iter().map(Vec::len).sum::<usize>();
+
+        if total > std::u32::MAX as usize {
+            panic!("Too many vertices to intern.");
+        }
+
+        self.labels.resize(total, 0);
+
+        // Hand out disjoint ranges of the label vector, and spread the stripes over the threads
+        let mut rest = &mut self.labels[first..];
+        let mut jobs: Vec<Vec<_>> = (0..*THREADS).map(|_| Vec::new()).collect();
+
+        for (stripe, (labels, ids)) in new_labels.into_iter().zip(self.ids.iter_mut()).enumerate() {
+            let range_len = labels.len();
+            let (range, tail) = std::mem::take(&mut rest).split_at_mut(range_len);
+            rest = tail;
+            jobs[stripe % *THREADS].push((first, range, labels, ids));
+            first += range_len;
+        }
+
+        crossbeam_utils::thread::scope(|scope| {
+            for job in jobs {
+                scope.spawn(move |_| {
+                    for (first, range, labels, ids) in job {
+                        for (i, (slot, label)) in range.iter_mut().zip(labels).enumerate() {
+                            *slot = label;
+                            ids.insert(label, (first + i) as u32);
+                        }
+                    }
+                });
+            }
+        })
+        .expect("Threads failed to join.");
+    }
+
+    /// Returns the identifier of a label if it has been interned.
+    pub fn get(&self, label: u128) -> Option<u32> {
+        self.ids[stripe_of(label)].get(&label).cloned()
+    }
+
+    /// Returns the label of an identifier.
+    pub fn label(&self, id: u32) -> u128 {
+        self.labels[id as usize]
+    }
+
+    /// Returns the number of interned labels.
+    pub fn len(&self) -> usize {
+        self.labels.len()
+    }
+
+    /// Check whether the interner is empty.
+    pub fn is_empty(&self) -> bool {
+        self.labels.is_empty()
+    }
+}
+
+/// A structure describing a directed multistage graph. Vertices are interned, and edges are
+/// stored by vertex identifier rather than by label.
+///
+/// Edges are always indexed tail to head. The index from head to tail is only built when it is
+/// needed, e.g. for pruning. For each vertex, masks of the stages with outgoing and incoming
+/// edges are kept up to date, as well as the number of vertices with outgoing and incoming
+/// edges in each stage.
 #[derive(Clone, Debug)]
 pub struct MultistageGraph {
-    forward: FnvHashMap<u128, FnvHashMap<u128, (u64, f64)>>,
-    backward: FnvHashMap<u128, FnvHashMap<u128, (u64, f64)>>,
+    interner: VertexInterner,
+    forward: Vec<FnvHashMap<u32, (u64, f64)>>,
+    backward: Option<Vec<FnvHashMap<u32, (u64, f64)>>>,
+    outgoing: Vec<u64>,
+    incoming: Vec<u64>,
+    num_outgoing: Vec<usize>,
+    num_incoming: Vec<usize>,
     stages: usize,
 }
 
@@ -19,30 +259,152 @@ impl MultistageGraph {
     /// Create a new empty multistage graph with a fixed number of stages.
     pub fn new(stages: usize) -> MultistageGraph {
         MultistageGraph {
-            forward: FnvHashMap::default(),
-            backward: FnvHashMap::default(),
+            interner: VertexInterner::new(),
+            forward: Vec::new(),
+            backward: None,
+            outgoing: Vec::new(),
+            incoming: Vec::new(),
+            num_outgoing: vec![0; 64],
+            num_incoming: vec![0; 64],
             stages,
         }
     }
 
-    /// Get a map of edges indexed tail to head.
-    pub fn forward_edges(&self) -> &FnvHashMap<u128, FnvHashMap<u128, (u64, f64)>> {
+    /// Get a list of edges indexed by tail identifier and then head identifier.
+    pub fn forward_edges(&self) -> &[FnvHashMap<u32, (u64, f64)>] {
         &self.forward
     }
 
-    /// Get a mutable map of edges indexed tail to head.
-    fn forward_edges_mut(&mut self) -> &mut FnvHashMap<u128, FnvHashMap<u128, (u64, f64)>> {
-        &mut self.forward
+    /// Get a list of edges indexed by head identifier and then tail identifier.
+    ///
+    /// # Panics
+    /// Panics if the backward edges haven't been built with `build_backward`.
+    pub fn backward_edges(&self) -> &[FnvHashMap<u32, (u64, f64)>] {
+        self.backward
+            .as_ref()
+            .expect("Backward edges have not been built.")
+    }
+
+    /// Check if the backward edges are currently built.
+    pub fn has_backward(&self) -> bool {
+        self.backward.is_some()
+    }
+
+    /// Builds the list of edges indexed by head from the forward edges, unless it already exists.
+    /// The vertices are split into ranges of identifiers, one per thread. Each thread first
+    /// sorts the edges of its tails into buckets by the range of their heads, and then inserts
+    /// the buckets of its own range of heads.
+    pub fn build_backward(&mut self) {
+        if self.backward.is_some() {
+            return;
+        }
+
+        let mut backward = vec![FnvHashMap::default(); self.forward.len()];
+        let chunk_size = std::cmp::max(1, (self.forward.len() + *THREADS - 1) / *THREADS);
+        let num_chunks = (self.forward.len() + chunk_size - 1) / chunk_size;
+        let forward = &self.forward;
+
+        // Bucket the edges of each range of tails by the range of their heads
+        let buckets: Vec<Vec<Vec<_>>> = crossbeam_utils::thread::scope(|scope| {
+            let handles: Vec<_> = forward
+                .chunks(chunk_size)
+                .enumerate()
+                .map(|(t, chunk)| {
+                    scope.spawn(move |_| {
+                        let mut buckets = vec![Vec::new(); num_chunks];
+
+                        for (i, heads) in chunk.iter().enumerate() {
+                            let tail = (t * chunk_size + i) as u32;
+
+                            for (&head, &edge) in heads {
+                                buckets[head as usize / chunk_size].push((head, tail, edge));
+                            }
+                        }
+
+                        buckets
+                    })
+                })
+                .collect();
+
+            handles
+                .into_iter()
+                .map(|handle| handle.join().expect("Thread failed to join."))
+                .collect()
+        })
+        .expect("Threads failed to join.");
+
+        // Hand each range of heads the buckets collected for it by every thread
+        let mut columns: Vec<Vec<Vec<_>>> = (0..num_chunks).map(|_| Vec::new()).collect();
+
+        for row in buckets {
+            for (column, bucket) in columns.iter_mut().zip(row) {
+                column.push(bucket);
+            }
+        }
+
+        crossbeam_utils::thread::scope(|scope| {
+            for ((t, chunk), column) in backward.chunks_mut(chunk_size).enumerate().zip(columns) {
+                scope.spawn(move |_| {
+                    let first = t * chunk_size;
+
+                    for bucket in column {
+                        for (head, tail, edge) in bucket {
+                            chunk[head as usize - first].insert(tail, edge);
+                        }
+                    }
+                });
+            }
+        })
+        .expect("Threads failed to join.");
+
+        self.backward = Some(backward);
+    }
+
+    /// Drops the backward edges to free memory.
+    pub fn release_backward(&mut self) {
+        self.backward = None;
+    }
+
+    /// Sets the masks of stages with outgoing and incoming edges of a vertex, and updates the
+    /// number of vertices in each stage accordingly.
+    fn set_stage_masks(&mut self, id: u32, outgoing: u64, incoming: u64) {
+        let id = id as usize;
+        update_counts(&mut self.num_outgoing, self.outgoing[id], outgoing);
+        update_counts(&mut self.num_incoming, self.incoming[id], incoming);
+        self.outgoing[id] = outgoing;
+        self.incoming[id] = incoming;
+    }
+
+    /// Recounts the number of vertices in each stage from the stage masks of all vertices.
+    fn recount(&mut self) {
+        self.num_outgoing = vec![0; 64];
+        self.num_incoming = vec![0; 64];
+
+        for (&outgoing, &incoming) in self.outgoing.iter().zip(self.incoming.iter()) {
+            update_counts(&mut self.num_outgoing, 0, outgoing);
+            update_counts(&mut self.num_incoming, 0, incoming);
+        }
+    }
+
+    /// Returns the stages in which the vertex with the given identifier occurs, as a binary
+    /// mask indexed by stage.
+    pub fn vertex_stages(&self, id: u32) -> u64 {
+        self.outgoing[id as usize] | (self.incoming[id as usize] << 1)
+    }
+
+    /// Returns the identifier of the vertex v, if it has been added to the graph.
+    pub fn vertex_id(&self, v: u128) -> Option<u32> {
+        self.interner.get(v)
     }
 
-    /// Get a map of edges indexed head to tail.
-    pub fn backward_edges(&self) -> &FnvHashMap<u128, FnvHashMap<u128, (u64, f64)>> {
-        &self.backward
+    /// Returns the label of the vertex with the given identifier.
+    pub fn label(&self, id: u32) -> u128 {
+        self.interner.label(id)
     }
 
-    /// Get a mutable map of edges indexed head to tail.
-    fn backward_edges_mut(&mut self) -> &mut FnvHashMap<u128, FnvHashMap<u128, (u64, f64)>> {
-        &mut self.backward
+    /// Returns the number of vertex identifiers assigned so far.
+    pub fn num_ids(&self) -> usize {
+        self.interner.len()
     }
 
     /// Get the number of stages.
@@ -54,17 +416,32 @@ impl MultistageGraph {
     pub fn insert_stage_before(&mut self) {
         self.stages += 1;
 
-        for edges in self.forward.values_mut() {
+        for edges in &mut self.forward {
             for e in edges.values_mut() {
                 *e = (e.0 << 1, e.1);
             }
         }
 
-        for edges in self.backward.values_mut() {
-            for e in edges.values_mut() {
-                *e = (e.0 << 1, e.1);
+        if let Some(backward) = &mut self.backward {
+            for edges in backward {
+                for e in edges.values_mut() {
+                    *e = (e.0 << 1, e.1);
+                }
             }
         }
+
+        for outgoing in &mut self.outgoing {
+            *outgoing <<= 1;
+        }
+
+        for incoming in &mut self.incoming {
+            *incoming <<= 1;
+        }
+
+        for counts in &mut [&mut self.num_outgoing, &mut self.num_incoming] {
+            counts.pop();
+            counts.insert(0, 0);
+        }
     }
 
     /// Insert a new stage at the end of the graph.
@@ -72,6 +449,23 @@ impl MultistageGraph {
         self.stages += 1;
     }
 
+    /// Returns the identifier of the vertex v, adding it to the graph if necessary.
+    fn intern(&mut self, v: u128) -> u32 {
+        let id = self.interner.intern(v);
+
+        if id as usize == self.forward.len() {
+            self.forward.push(FnvHashMap::default());
+            self.outgoing.push(0);
+            self.incoming.push(0);
+
+            if let Some(backward) = &mut self.backward {
+                backward.push(FnvHashMap::default());
+            }
+        }
+
+        id
+    }
+
     /// Add an edge to one or more stages of the graph.
     ///
     /// # Panics
@@ -81,8 +475,19 @@ impl MultistageGraph {
             return;
         }
 
-        let entry_tail = self.forward.entry(tail).or_insert_with(FnvHashMap::default);
-        let entry_head = entry_tail.entry(head).or_insert((0, length));
+        let tail = self.intern(tail);
+        let head = self.intern(head);
+        self.add_edges_by_id(tail, head, stages, length);
+    }
+
+    /// Add an edge between two vertices given by their identifiers.
+    ///
+    /// # Panics
+    /// Panics if the graph already has an edge of this type but with a different length.
+    fn add_edges_by_id(&mut self, tail: u32, head: u32, stages: u64, length: f64) {
+        let entry_head = self.forward[tail as usize]
+            .entry(head)
+            .or_insert((0, length));
 
         if (entry_head.1 - length).abs() > std::f64::EPSILON {
             panic!("Lengths are incompatible.");
@@ -90,80 +495,76 @@ impl MultistageGraph {
 
         entry_head.0 |= stages;
 
-        let entry_head = self
-            .backward
-            .entry(head)
-            .or_insert_with(FnvHashMap::default);
-        let entry_tail = entry_head.entry(tail).or_insert((0, length));
+        let outgoing = self.outgoing[tail as usize] | stages;
+        self.set_stage_masks(tail, outgoing, self.incoming[tail as usize]);
+        let incoming = self.incoming[head as usize] | stages;
+        self.set_stage_masks(head, self.outgoing[head as usize], incoming);
 
-        if (entry_tail.1 - length).abs() > std::f64::EPSILON {
-            panic!("Lengths are incompatible.");
-        }
+        if let Some(backward) = &mut self.backward {
+            let entry_tail = backward[head as usize].entry(tail).or_insert((0, length));
+
+            if (entry_tail.1 - length).abs() > std::f64::EPSILON {
+                panic!("Lengths are incompatible.");
+            }
 
-        entry_tail.0 |= stages;
+            entry_tail.0 |= stages;
+        }
     }
 
-    /// Remove an edge from one or more stages of the graph.
-    pub fn remove_edges(&mut self, tail: u128, head: u128, stages: u64) {
+    /// Remove an edge from one or more stages of the graph. The vertices are given by their
+    /// identifiers. Note that this builds the backward edges if they don't already exist.
+    pub fn remove_edges_by_id(&mut self, tail: u32, head: u32, stages: u64) {
         if stages >= (1 << self.stages) {
             return;
         }
 
-        let empty_edge;
-
-        let entry_tail_f = match self.forward.get_mut(&tail) {
-            Some(entry_tail_f) => {
-                match entry_tail_f.get_mut(&head) {
-                    Some(entry_head_f) => {
-                        entry_head_f.0 &= !stages;
-
-                        empty_edge = entry_head_f.0 == 0;
-                    }
-                    None => return,
-                };
+        self.build_backward();
+        let backward = self
+            .backward
+            .as_mut()
+            .expect("Backward edges were just built.");
 
-                entry_tail_f
+        let empty_edge = match self.forward[tail as usize].get_mut(&head) {
+            Some(entry_head_f) => {
+                entry_head_f.0 &= !stages;
+                entry_head_f.0 == 0
             }
             None => return,
         };
 
-        let entry_head_b = match self.backward.get_mut(&head) {
-            Some(entry_head_b) => {
-                match entry_head_b.get_mut(&tail) {
-                    Some(entry_tail_b) => {
-                        entry_tail_b.0 &= !stages;
-                    }
-                    None => return,
-                };
-
-                entry_head_b
-            }
+        match backward[head as usize].get_mut(&tail) {
+            Some(entry_tail_b) => entry_tail_b.0 &= !stages,
             None => return,
         };
 
         if empty_edge {
-            entry_tail_f.remove(&head);
-            entry_head_b.remove(&tail);
-        }
+            let heads = &mut self.forward[tail as usize];
+            heads.remove(&head);
 
-        if entry_tail_f.is_empty() {
-            self.forward.remove(&tail);
-        }
+            // Release the memory of vertices without edges
+            if heads.is_empty() {
+                *heads = FnvHashMap::default();
+            }
 
-        if entry_head_b.is_empty() {
-            self.backward.remove(&head);
+            let tails = &mut backward[head as usize];
+            tails.remove(&tail);
+
+            if tails.is_empty() {
+                *tails = FnvHashMap::default();
+            }
         }
+
+        let outgoing = stage_mask(&self.forward[tail as usize]);
+        let incoming = stage_mask(&backward[head as usize]);
+        self.set_stage_masks(tail, outgoing, self.incoming[tail as usize]);
+        self.set_stage_masks(head, self.outgoing[head as usize], incoming);
     }
 
     /// Check if there is a vertex v with an outgoing edge in the given stage.
     pub fn has_vertex_outgoing(&self, v: u128, stage: usize) -> bool {
         if stage < self.stages {
-            if let Some(heads) = self.forward.get(&v) {
-                for (stages, _) in heads.values() {
-                    if ((stages >> stage) & 0x1) == 1 {
-                        return true;
-                    }
-                }
+            if let Some(id) = self.vertex_id(v) {
+                return ((self.outgoing[id as usize] >> stage) & 0x1) == 1;
             }
         }
 
@@ -173,12 +574,8 @@ impl MultistageGraph {
     /// Check if there is a vertex v with an incoming edge in the given stage.
     pub fn has_vertex_incoming(&self, v: u128, stage: usize) -> bool {
         if stage > 0 {
-            if let Some(tails) = self.backward.get(&v) {
-                for (stages, _) in tails.values() {
-                    if ((stages >> (stage - 1)) & 0x1) == 1 {
-                        return true;
-                    }
-                }
+            if let Some(id) = self.vertex_id(v) {
+                return ((self.incoming[id as usize] >> (stage - 1)) & 0x1) == 1;
             }
         }
 
@@ -190,10 +587,18 @@ impl MultistageGraph {
         self.has_vertex_outgoing(v, stage) || self.has_vertex_incoming(v, stage)
     }
 
+    /// Check if the vertex v has any edges in the graph.
+    pub fn contains_vertex(&self, v: u128) -> bool {
+        match self.vertex_id(v) {
+            Some(id) => self.vertex_stages(id) != 0,
+            None => false,
+        }
+    }
+
     /// Returns the binary representation of the stages where the edge exists
     pub fn get_edge(&self, tail: u128, head: u128) -> u64 {
-        if let Some(heads) = self.forward.get(&tail) {
-            if let Some(&(edge, _)) = heads.get(&head) {
+        if let (Some(tail), Some(head)) = (self.vertex_id(tail), self.vertex_id(head)) {
+            if let Some(&(edge, _)) = self.forward[tail as usize].get(&head) {
                 return edge;
             }
         }
@@ -203,14 +608,11 @@ impl MultistageGraph {
 
     /// Returns all vertices with outgoing edges in the given stage.
     pub fn get_vertices_outgoing(&self, stage: usize) -> Vec<u128> {
-        let mut vertices = Vec::new();
+        let mut vertices = Vec::with_capacity(self.num_outgoing[stage]);
 
-        for (tail, heads) in self.forward_edges() {
-            for &(stages, _) in heads.values() {
-                if ((stages >> stage) & 0x1) == 1 {
-                    vertices.push(*tail);
-                    break;
-                }
+        for (tail, &outgoing) in self.outgoing.iter().enumerate() {
+            if ((outgoing >> stage) & 0x1) == 1 {
+                vertices.push(self.label(tail as u32));
             }
         }
 
@@ -223,171 +625,417 @@ impl MultistageGraph {
             return Vec::new();
         }
 
-        let mut vertices = Vec::new();
+        let mut vertices = Vec::with_capacity(self.num_incoming[stage - 1]);
 
-        for (head, tails) in self.backward_edges() {
-            for &(stages, _) in tails.values() {
-                if ((stages >> (stage - 1)) & 0x1) == 1 {
-                    vertices.push(*head);
-                    break;
-                }
+        for (head, &incoming) in self.incoming.iter().enumerate() {
+            if ((incoming >> (stage - 1)) & 0x1) == 1 {
+                vertices.push(self.label(head as u32));
             }
         }
 
         vertices
     }
 
-    /// Returns the binary representation of v's predecessors in each stage.
-    fn has_predecessors(&self, v: u128) -> u64 {
-        if let Some(entry) = self.backward.get(&v) {
-            return entry.values().fold(0, |sum, x| sum | x.0) << 1;
-        }
-
-        0
-    }
-
-    /// Returns the binary representation of v's successors in each stage.
-    fn has_successors(&self, v: u128) -> u64 {
-        if let Some(entry) = self.forward.get(&v) {
-            return entry.values().fold(0, |sum, x| sum | x.0) >> 1;
-        }
-
-        0
-    }
-
     /// Remove any edges that aren't part of a path from a vertex in stage `start` to
     /// a vertex in stage `stop`.
+    ///
+    /// The vertices reachable from stage `start` are found by expanding a worklist one stage at
+    /// a time, and likewise for the vertices from which stage `stop` can be reached. An edge
+    /// survives if its tail is reachable and its head can reach stage `stop`. This gives the
+    /// same result as repeatedly removing edges without predecessors or successors.
     pub fn prune(&mut self, start: usize, stop: usize) {
-        let mask = !((1 << start) - 1) & ((1 << stop) - 1);
+        if start >= stop {
+            return;
+        }
 
-        loop {
-            let mut remove = Vec::new();
+        let mask = !((1 << start) - 1) & ((1 << stop) - 1);
+        self.build_backward();
 
-            for (&tail, heads) in &self.forward {
-                let no_predecessors = !self.has_predecessors(tail);
+        let forward = &self.forward;
+        let backward = self
+            .backward
+            .as_ref()
+            .expect("Backward edges were just built.");
+
+        // Bit s of reachable[v] is set if v can be reached from stage `start` in stage s
+        let mut reachable = vec![0; forward.len()];
+        let mut worklist: Vec<u32> = (0..forward.len() as u32)
+            .filter(|&v| {
+                forward[v as usize]
+                    .values()
+                    .any(|x| (x.0 >> start) & 0x1 == 1)
+            })
+            .collect();
+
+        for &v in &worklist {
+            reachable[v as usize] |= 1 << start;
+        }
 
-                for (&head, edges) in heads {
-                    let targets = (edges.0 & no_predecessors) & !(1 << start);
-                    let targets = targets & mask;
+        for stage in start..stop - 1 {
+            worklist = expand_worklist(forward, &worklist, stage)
+                .into_iter()
+                .filter(|&v| {
+                    let found = (reachable[v as usize] >> (stage + 1)) & 0x1 == 1;
+                    reachable[v as usize] |= 1 << (stage + 1);
+                    !found
+                })
+                .collect();
+        }
 
-                    if targets != 0 {
-                        remove.push((tail, head, targets));
-                    }
-                }
-            }
+        // Bit s of coreachable[v] is set if stage `stop` can be reached from v in stage s
+        let mut coreachable = vec![0; forward.len()];
+        let mut worklist: Vec<u32> = (0..backward.len() as u32)
+            .filter(|&v| {
+                backward[v as usize]
+                    .values()
+                    .any(|x| (x.0 >> (stop - 1)) & 0x1 == 1)
+            })
+            .collect();
+
+        for &v in &worklist {
+            coreachable[v as usize] |= 1 << stop;
+        }
 
-            let mut pruned = !remove.is_empty();
+        for stage in (start + 1..stop).rev() {
+            worklist = expand_worklist(backward, &worklist, stage)
+                .into_iter()
+                .filter(|&v| {
+                    let found = (coreachable[v as usize] >> stage) & 0x1 == 1;
+                    coreachable[v as usize] |= 1 << stage;
+                    !found
+                })
+                .collect();
+        }
 
-            for &(tail, head, stages) in &remove {
-                self.remove_edges(tail, head, stages);
+        // Remove the edges in both directions in parallel
+        let chunk_size = std::cmp::max(1, (forward.len() + *THREADS - 1) / *THREADS);
+        let reachable = &reachable;
+        let coreachable = &coreachable;
+        let forward = &mut self.forward;
+        let backward = self
+            .backward
+            .as_mut()
+            .expect("Backward edges were just built.");
+        let outgoing = &mut self.outgoing;
+        let incoming = &mut self.incoming;
+
+        crossbeam_utils::thread::scope(|scope| {
+            let chunks = forward
+                .chunks_mut(chunk_size)
+                .zip(outgoing.chunks_mut(chunk_size));
+
+            for (t, (chunk, masks)) in chunks.enumerate() {
+                scope.spawn(move |_| {
+                    for (i, (heads, mask_out)) in chunk.iter_mut().zip(masks).enumerate() {
+                        let tail = t * chunk_size + i;
+
+                        remove_dead_edges(heads, mask, |head| {
+                            reachable[tail] & (coreachable[head as usize] >> 1)
+                        });
+                        *mask_out = stage_mask(heads);
+                    }
+                });
             }
 
-            remove.clear();
+            let chunks = backward
+                .chunks_mut(chunk_size)
+                .zip(incoming.chunks_mut(chunk_size));
 
-            for (&head, tails) in &self.backward {
-                let no_successors = !self.has_successors(head);
+            for (t, (chunk, masks)) in chunks.enumerate() {
+                scope.spawn(move |_| {
+                    for (i, (tails, mask_in)) in chunk.iter_mut().zip(masks).enumerate() {
+                        let head = t * chunk_size + i;
 
-                for (&tail, edges) in tails {
-                    let targets = (edges.0 & no_successors) & !(1 << (stop - 1));
-                    let targets = targets & mask;
-
-                    if targets != 0 {
-                        remove.push((tail, head, targets));
+                        remove_dead_edges(tails, mask, |tail| {
+                            reachable[tail as usize] & (coreachable[head] >> 1)
+                        });
+                        *mask_in = stage_mask(tails);
                     }
-                }
+                });
             }
+        })
+        .expect("Threads failed to join.");
 
-            pruned |= !remove.is_empty();
-
-            for &(tail, head, stages) in &remove {
-                self.remove_edges(tail, head, stages);
-            }
-
-            if !pruned {
-                break;
-            }
-        }
+        self.recount();
     }
 
     /// Returns the number of edges in the graph.
     pub fn num_edges(&self) -> usize {
         self.forward
-            .values()
+            .iter()
             .fold(0, |e, v| e + v.values().fold(0, |e, &v| e + hw(v.0))) as usize
     }
 
     /// Returns the number of vertices in a given stage.
     pub fn num_vertices(&self, stage: usize) -> usize {
-        let mut count = 0;
-
         if stage < self.stages {
-            for heads in self.forward.values() {
-                for (stages, _) in heads.values() {
-                    if ((stages >> stage) & 0x1) == 1 {
-                        count += 1;
-                        break;
-                    }
-                }
-            }
+            self.num_outgoing[stage]
         } else if stage == self.stages {
-            for tails in self.backward.values() {
-                for (stages, _) in tails.values() {
-                    if ((stages >> (stage - 1)) & 0x1) == 1 {
-                        count += 1;
-                        break;
-                    }
-                }
-            }
+            self.num_incoming[stage - 1]
+        } else {
+            0
         }
+    }
 
-        count
+    /// Converts the graph to a compact, read-only representation. This is done once the graph
+    /// is fully constructed, since the frozen graph takes up much less memory.
+    pub fn freeze(self) -> FrozenGraph {
+        FrozenGraph::new(&self)
     }
 
-    /// Adds all edges of another graph to this graph, leaving the other graph empty.
+    /// Adds the edges collected by a set of shard builders to the graph. New vertices are
+    /// interned in parallel, after which each shard is translated to identifiers by its own
+    /// thread and its edges are sent to the threads owning the ranges of tail and head
+    /// identifiers. Each shard is freed as soon as it has been merged.
     ///
     /// # Panics
-    /// Panics if the two graphs have a different number of stages.
-    pub fn union(&mut self, other: &mut MultistageGraph) {
-        if self.stages() != other.stages() {
-            panic!("Cannot take union of graphs with different number of stages.")
-        }
+    /// Panics if the graph already has an edge of this type but with a different length.
+    pub fn add_shards(&mut self, shards: Vec<EdgeShard>) {
+        // Backward edges are rebuilt by the next call which needs them, e.g. `prune`
+        self.release_backward();
+
+        let shards: Vec<_> = shards.into_iter().map(EdgeShard::into_edges).collect();
+        self.intern_shards(&shards);
+
+        let num_vertices = self.interner.len();
+        self.forward.resize_with(num_vertices, FnvHashMap::default);
+        self.outgoing.resize(num_vertices, 0);
+        self.incoming.resize(num_vertices, 0);
+
+        let chunk_size = std::cmp::max(1, (num_vertices + *THREADS - 1) / *THREADS);
+        let num_chunks = (num_vertices + chunk_size - 1) / chunk_size;
+        let (senders, receivers): (Vec<_>, Vec<_>) = (0..num_chunks)
+            .map(|_| mpsc::sync_channel(MERGE_BOUND))
+            .unzip();
+
+        let interner = &self.interner;
+        let chunks = self.forward.chunks_mut(chunk_size).zip(
+            self.outgoing
+                .chunks_mut(chunk_size)
+                .zip(self.incoming.chunks_mut(chunk_size)),
+        );
+
+        // Start scoped worker threads
+        crossbeam_utils::thread::scope(|scope| {
+            // Each owner inserts the edges of its tails and the stages of its heads
+            for ((t, (chunk, (outgoing, incoming))), receiver) in chunks.enumerate().zip(receivers)
+            {
+                scope.spawn(move |_| {
+                    let first = t * chunk_size;
+
+                    for batch in receiver.iter() {
+                        match batch {
+                            MergeBatch::Edges(edges) => {
+                                for (tail, head, stages, length) in edges {
+                                    let tail = tail as usize - first;
+                                    let entry = chunk[tail].entry(head).or_insert((0, length));
+
+                                    if (entry.1 - length).abs() > std::f64::EPSILON {
+                                        panic!("Lengths are incompatible.");
+                                    }
+
+                                    entry.0 |= stages;
+                                    outgoing[tail] |= stages;
+                                }
+                            }
+                            MergeBatch::Heads(heads) => {
+                                for (head, stages) in heads {
+                                    incoming[head as usize - first] |= stages;
+                                }
+                            }
+                        }
+                    }
+                });
+            }
+
+            for shard in shards {
+                let senders = senders.clone();
+
+                scope.spawn(move |_| {
+                    let mut edges: Vec<Vec<_>> = vec![Vec::new(); num_chunks];
+                    let mut heads: Vec<Vec<_>> = vec![Vec::new(); num_chunks];
+                    let send = |owner: usize, batch| {
+                        senders[owner]
+                            .send(batch)
+                            .expect("Thread could not send edges.");
+                    };
+
+                    for (tail, tail_heads) in shard {
+                        let tail = interner.get(tail).expect("Vertex was just interned.");
+                        let tail_owner = tail as usize / chunk_size;
+
+                        for (head, (stages, length)) in tail_heads {
+                            let head = interner.get(head).expect("Vertex was just interned.");
+                            let head_owner = head as usize / chunk_size;
+
+                            edges[tail_owner].push((tail, head, stages, length));
+                            heads[head_owner].push((head, stages));
+
+                            if edges[tail_owner].len() >= MERGE_BATCH {
+                                let batch = std::mem::take(&mut edges[tail_owner]);
+                                send(tail_owner, MergeBatch::Edges(batch));
+                            }
+
+                            if heads[head_owner].len() >= MERGE_BATCH {
+                                let batch = std::mem::take(&mut heads[head_owner]);
+                                send(head_owner, MergeBatch::Heads(batch));
+                            }
+                        }
+                    }
+
+                    for (owner, (edges, heads)) in edges.into_iter().zip(heads).enumerate() {
+                        if !edges.is_empty() {
+                            send(owner, MergeBatch::Edges(edges));
+                        }
 
-        for (tail, mut heads) in other.forward_edges_mut().drain() {
-            if !self.forward.contains_key(&tail) {
-                self.forward.insert(tail, heads.clone());
-            } else {
-                let entry_tail = self.forward.get_mut(&tail).expect("This shouldn't happen.");
+                        if !heads.is_empty() {
+                            send(owner, MergeBatch::Heads(heads));
+                        }
+                    }
+                });
+            }
+
+            // The owners stop once every shard thread has dropped its senders
+            drop(senders);
+        })
+        .expect("Threads failed to join.");
+
+        self.recount();
+    }
 
-                for (head, (stages, length)) in heads.drain() {
-                    let entry_head = entry_tail.entry(head).or_insert((0, length));
+    /// Interns the vertices of a set of shards which are not in the graph yet. The labels of
+    /// each shard are first split by interner stripe, after which each stripe is deduplicated
+    /// and interned by its own thread.
+    fn intern_shards(&mut self, shards: &[FnvHashMap<u128, FnvHashMap<u128, (u64, f64)>>]) {
+        let interner = &self.interner;
+        let mut by_shard = Vec::new();
+
+        crossbeam_utils::thread::scope(|scope| {
+            let handles: Vec<_> = shards
+                .iter()
+                .map(|shard| {
+                    scope.spawn(move |_| {
+                        let mut stripes = vec![Vec::new(); INTERNER_STRIPES];
+                        let mut push = |label: u128| {
+                            if interner.get(label).is_none() {
+                                stripes[stripe_of(label)].push(label);
+                            }
+                        };
+
+                        for (&tail, heads) in shard {
+                            push(tail);
+                            heads.keys().for_each(|&head| push(head));
+                        }
+
+                        stripes
+                    })
+                })
+                .collect();
+
+            by_shard = handles
+                .into_iter()
+                .map(|handle| handle.join().expect("Thread failed to join."))
+                .collect();
+        })
+        .expect("Threads failed to join.");
+
+        // Regroup the labels by stripe, and give each thread a share of the stripes
+        let mut by_stripe: Vec<Vec<Vec<u128>>> = vec![Vec::new(); INTERNER_STRIPES];
+
+        for stripes in by_shard {
+            for (stripe, labels) in stripes.into_iter().enumerate() {
+                by_stripe[stripe].push(labels);
+            }
+        }
 
-                    if (entry_head.1 - length).abs() > std::f64::EPSILON {
-                        panic!("Lengths are incompatible.");
+        let mut new_labels = vec![Vec::new(); INTERNER_STRIPES];
+        let chunk_size = (INTERNER_STRIPES + *THREADS - 1) / *THREADS;
+
+        crossbeam_utils::thread::scope(|scope| {
+            for (stripes, results) in by_stripe
+                .chunks_mut(chunk_size)
+                .zip(new_labels.chunks_mut(chunk_size))
+            {
+                scope.spawn(move |_| {
+                    for (parts, result) in stripes.iter_mut().zip(results.iter_mut()) {
+                        let mut seen = FnvHashSet::default();
+
+                        for label in std::mem::take(parts).into_iter().flatten() {
+                            if seen.insert(label) {
+                                result.push(label);
+                            }
+                        }
                     }
+                });
+            }
+        })
+        .expect("Threads failed to join.");
 
-                    entry_head.0 |= stages;
-                }
+        self.interner.extend_striped(new_labels);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::MultistageGraph;
+    use fnv::FnvHashSet;
+
+    /// Prunes a set of (tail, head, stage) edges the simple way, by repeatedly removing edges in
+    /// stages `start..stop` whose tail has no predecessor or whose head has no successor.
+    fn fixpoint_prune(edges: &mut FnvHashSet<(u128, u128, usize)>, start: usize, stop: usize) {
+        loop {
+            let dead: Vec<_> = edges
+                .iter()
+                .filter(|&&(tail, head, stage)| {
+                    let orphan = stage > start
+                        && !edges.iter().any(|&(_, h, s)| s + 1 == stage && h == tail);
+                    let dead_end = stage + 1 < stop
+                        && !edges.iter().any(|&(t, _, s)| s == stage + 1 && t == head);
+                    stage >= start && stage < stop && (orphan || dead_end)
+                })
+                .cloned()
+                .collect();
+
+            if dead.is_empty() {
+                break;
             }
+
+            for edge in dead {
+                edges.remove(&edge);
+            }
+        }
+    }
+
+    #[test]
+    fn prune_matches_fixpoint() {
+        let stages = 5;
+        let mut edges = FnvHashSet::default();
+
+        for i in 0..40 {
+            let stage = i % stages;
+            edges.insert(((i * 7 % 17) as u128, ((i * 11 + stage) % 17) as u128, stage));
         }
 
-        for (head, mut tails) in other.backward_edges_mut().drain() {
-            if !self.backward.contains_key(&head) {
-                self.backward.insert(head, tails.clone());
-            } else {
-                let entry_head = self
-                    .backward
-                    .get_mut(&head)
-                    .expect("This shouldn't happen.");
+        // A chain ending a stage early, which dies one edge at a time from its end
+        for stage in 0..stages - 1 {
+            edges.insert((100 + stage as u128, 101 + stage as u128, stage));
+        }
 
-                for (tail, (stages, length)) in tails.drain() {
-                    let entry_tail = entry_head.entry(tail).or_insert((0, length));
+        for &(start, stop) in &[(0, stages), (1, stages - 1), (0, 2), (2, stages), (3, 4)] {
+            let mut graph = MultistageGraph::new(stages);
 
-                    if (entry_tail.1 - length).abs() > std::f64::EPSILON {
-                        panic!("Lengths are incompatible.");
-                    }
+            for &(tail, head, stage) in &edges {
+                graph.add_edges(tail, head, 1 << stage, 1.0);
+            }
 
-                    entry_tail.0 |= stages;
-                }
+            let mut expected = edges.clone();
+            fixpoint_prune(&mut expected, start, stop);
+            graph.prune(start, stop);
+            assert_eq!(graph.num_edges(), expected.len());
+
+            for &(tail, head, stage) in &edges {
+                let kept = (graph.get_edge(tail, head) >> stage) & 0x1 == 1;
+                assert_eq!(kept, expected.contains(&(tail, head, stage)));
             }
         }
     }
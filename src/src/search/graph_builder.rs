@@ -0,0 +1,218 @@
+//! Types for building a multistage graph concurrently from several threads.
+
+use fnv::{FnvHashMap, FnvHasher};
+use std::hash::Hasher;
+use std::sync::mpsc::{self, Receiver, SyncSender, TrySendError};
+
+// The number of edges buffered for a shard before they are sent to its owner
+const BATCH_SIZE: usize = 1 << 12;
+
+// The number of batches which can be queued for a shard before its senders have to wait
+const CHANNEL_BOUND: usize = 16;
+
+/// An edge given by tail, head, stages and length.
+type Edge = (u128, u128, u64, f64);
+
+/// The edges of a graph whose tails belong to a single shard. Duplicate edges are merged.
+#[derive(Clone, Debug, Default)]
+pub struct EdgeShard {
+    edges: FnvHashMap<u128, FnvHashMap<u128, (u64, f64)>>,
+}
+
+impl EdgeShard {
+    /// Add edges to one or more stages of the shard.
+    ///
+    /// # Panics
+    /// Panics if the shard already has an edge of this type but with a different length.
+    fn add_edges(&mut self, tail: u128, head: u128, stages: u64, length: f64) {
+        let entry = self
+            .edges
+            .entry(tail)
+            .or_insert_with(FnvHashMap::default)
+            .entry(head)
+            .or_insert((0, length));
+
+        if (entry.1 - length).abs() > std::f64::EPSILON {
+            panic!("Lengths are incompatible.");
+        }
+
+        entry.0 |= stages;
+    }
+
+    /// Returns the edges of the shard, indexed by tail and then head.
+    pub fn into_edges(self) -> FnvHashMap<u128, FnvHashMap<u128, (u64, f64)>> {
+        self.edges
+    }
+}
+
+/// Collects edges generated by one thread and merges the edges of the shard it owns. Edges
+/// belonging to other shards are buffered and sent to their owners in batches. Batches received
+/// from other threads are merged while edges are being added, and while waiting for a full
+/// channel to drain, so that the builders cannot block each other.
+pub struct ShardBuilder {
+    shard: EdgeShard,
+    index: usize,
+    stages: usize,
+    buffers: Vec<Vec<Edge>>,
+    senders: Vec<SyncSender<Vec<Edge>>>,
+    receiver: Receiver<Vec<Edge>>,
+}
+
+/// Creates a set of builders for a graph with the given number of stages, one for each shard.
+/// Each builder must be moved to its own thread, since `finish` waits for all other builders.
+pub fn shard_builders(stages: usize, num_shards: usize) -> Vec<ShardBuilder> {
+    let (senders, receivers): (Vec<_>, Vec<_>) = (0..num_shards)
+        .map(|_| mpsc::sync_channel(CHANNEL_BOUND))
+        .unzip();
+
+    receivers
+        .into_iter()
+        .enumerate()
+        .map(|(index, receiver)| ShardBuilder {
+            shard: EdgeShard::default(),
+            index,
+            stages,
+            buffers: vec![Vec::new(); num_shards],
+            senders: senders.clone(),
+            receiver,
+        })
+        .collect()
+}
+
+impl ShardBuilder {
+    /// Returns the shard owning the edges of a given tail.
+    fn shard_of(&self, tail: u128) -> usize {
+        let mut hasher = FnvHasher::default();
+        hasher.write_u128(tail);
+        (hasher.finish() % self.buffers.len() as u64) as usize
+    }
+
+    /// Merges any batches of edges received from other builders into the owned shard.
+    fn merge_received(&mut self) {
+        while let Ok(batch) = self.receiver.try_recv() {
+            for (tail, head, stages, length) in batch {
+                self.shard.add_edges(tail, head, stages, length);
+            }
+        }
+    }
+
+    /// Sends a batch of edges to the builder owning their shard. While the channel of that
+    /// builder is full, received batches are merged instead of blocking.
+    fn send(&mut self, shard: usize, mut batch: Vec<Edge>) {
+        loop {
+            match self.senders[shard].try_send(batch) {
+                Ok(()) => return,
+                Err(TrySendError::Full(returned)) => {
+                    batch = returned;
+                    self.merge_received();
+                    std::thread::yield_now();
+                }
+                Err(TrySendError::Disconnected(_)) => panic!("Could not send edges to shard."),
+            }
+        }
+    }
+
+    /// Add an edge to one or more stages of the graph. As for `MultistageGraph::add_edges`,
+    /// edges without stages or with stages outside the graph are ignored.
+    pub fn add_edges(&mut self, tail: u128, head: u128, stages: u64, length: f64) {
+        if stages == 0 || stages >= (1 << self.stages) {
+            return;
+        }
+
+        let shard = self.shard_of(tail);
+
+        if shard == self.index {
+            self.shard.add_edges(tail, head, stages, length);
+            return;
+        }
+
+        self.buffers[shard].push((tail, head, stages, length));
+
+        if self.buffers[shard].len() >= BATCH_SIZE {
+            let batch = std::mem::replace(&mut self.buffers[shard], Vec::new());
+            self.send(shard, batch);
+            self.merge_received();
+        }
+    }
+
+    /// Sends the remaining buffered edges to their shards and waits until all other builders
+    /// have done the same. Returns the merged edges of the owned shard.
+    pub fn finish(mut self) -> EdgeShard {
+        for shard in 0..self.buffers.len() {
+            if !self.buffers[shard].is_empty() {
+                let batch = std::mem::replace(&mut self.buffers[shard], Vec::new());
+                self.send(shard, batch);
+            }
+        }
+
+        // The channel closes once every builder has dropped its senders
+        self.senders.clear();
+
+        for batch in self.receiver.iter() {
+            for (tail, head, stages, length) in batch {
+                self.shard.add_edges(tail, head, stages, length);
+            }
+        }
+
+        self.shard
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::shard_builders;
+    use crate::search::graph::MultistageGraph;
+    use crossbeam_utils;
+
+    #[test]
+    fn sharded_edges_match_serial_edges() {
+        let builders = shard_builders(3, 4);
+        let mut serial = MultistageGraph::new(3);
+
+        for t in 0..4 {
+            for i in 0..1000 {
+                serial.add_edges(i % 97, (i * t) % 89, 1 << (i % 3), 0.5);
+            }
+        }
+
+        let shards = crossbeam_utils::thread::scope(|scope| {
+            let handles: Vec<_> = builders
+                .into_iter()
+                .enumerate()
+                .map(|(t, mut builder)| {
+                    scope.spawn(move |_| {
+                        for i in 0..1000 {
+                            builder.add_edges(i % 97, (i * t as u128) % 89, 1 << (i % 3), 0.5);
+                        }
+
+                        builder.finish()
+                    })
+                })
+                .collect();
+
+            handles
+                .into_iter()
+                .map(|handle| handle.join().expect("Thread failed to join."))
+                .collect()
+        })
+        .expect("Threads failed to join.");
+
+        let mut sharded = MultistageGraph::new(3);
+        sharded.add_shards(shards);
+
+        assert_eq!(sharded.num_edges(), serial.num_edges());
+
+        for tail in 0..97 {
+            for head in 0..89 {
+                assert_eq!(sharded.get_edge(tail, head), serial.get_edge(tail, head));
+            }
+
+            for stage in 0..3 {
+                assert_eq!(
+                    sharded.has_vertex_incoming(tail, stage + 1),
+                    serial.has_vertex_incoming(tail, stage + 1)
+                );
+            }
+        }
+    }
+}
@@ -0,0 +1,1163 @@
+//! Types for representing a multistage graph in a compact, read-only form.
+
+use crossbeam_utils;
+use fnv::{FnvHashMap, FnvHashSet};
+use num_cpus;
+use std::borrow::Cow;
+use std::fs::{self, File};
+use std::io::{BufReader, BufWriter, Read, Write};
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::mpsc;
+
+use crate::cipher::Cipher;
+use crate::property::PropertyType;
+use crate::search::graph::MultistageGraph;
+
+// The number of threads used for parallel calls is fixed
+lazy_static! {
+    static ref THREADS: usize = num_cpus::get();
+}
+
+// Graph snapshots start with this identifier, followed by the format version
+const SNAPSHOT_MAGIC: &[u8; 8] = b"CGRAPHSN";
+const SNAPSHOT_VERSION: u64 = 4;
+
+// Distinguishes the spill files of graphs in the same process
+static NEXT_SPILL_ID: AtomicUsize = AtomicUsize::new(0);
+
+/// Writes an integer in little-endian byte order.
+pub fn write_u64<W: Write>(writer: &mut W, x: u64) {
+    writer
+        .write_all(&x.to_le_bytes())
+        .expect("Could not write to file.");
+}
+
+/// Reads an integer in little-endian byte order.
+pub fn read_u64<R: Read>(reader: &mut R) -> u64 {
+    let mut buffer = [0; 8];
+    reader
+        .read_exact(&mut buffer)
+        .expect("Could not read from file.");
+    u64::from_le_bytes(buffer)
+}
+
+/// Writes a 32-bit integer in little-endian byte order.
+fn write_u32<W: Write>(writer: &mut W, x: u32) {
+    writer
+        .write_all(&x.to_le_bytes())
+        .expect("Could not write to file.");
+}
+
+/// Reads a 32-bit integer in little-endian byte order.
+fn read_u32<R: Read>(reader: &mut R) -> u32 {
+    let mut buffer = [0; 4];
+    reader
+        .read_exact(&mut buffer)
+        .expect("Could not read from file.");
+    u32::from_le_bytes(buffer)
+}
+
+/// Encodes a property type for graph snapshots and checkpoints.
+pub fn property_type_id(property_type: PropertyType) -> u64 {
+    match property_type {
+        PropertyType::Linear => 0,
+        PropertyType::Differential => 1,
+    }
+}
+
+/// Appends an integer to a byte vector as an LEB128 varint.
+fn write_varint(bytes: &mut Vec<u8>, mut x: u64) {
+    while x >= 0x80 {
+        bytes.push((x as u8) | 0x80);
+        x >>= 7;
+    }
+
+    bytes.push(x as u8);
+}
+
+/// Decodes an LEB128 varint from the start of a byte slice and advances the slice past it.
+#[inline]
+fn read_varint(bytes: &mut &[u8]) -> u64 {
+    let mut value = 0;
+    let mut shift = 0;
+
+    loop {
+        let byte = bytes[0];
+        *bytes = &bytes[1..];
+        value |= u64::from(byte & 0x7f) << shift;
+
+        if byte & 0x80 == 0 {
+            return value;
+        }
+
+        shift += 7;
+    }
+}
+
+/// An iterator over the edges of a single vertex, given as pairs of target index and index into
+/// the length table.
+enum RawEdges<'a> {
+    Plain(std::iter::Zip<std::slice::Iter<'a, u32>, std::slice::Iter<'a, u32>>),
+    Packed {
+        bytes: &'a [u8],
+        target: usize,
+        remaining: usize,
+    },
+}
+
+impl<'a> Iterator for RawEdges<'a> {
+    type Item = (usize, u32);
+
+    #[inline]
+    fn next(&mut self) -> Option<(usize, u32)> {
+        match self {
+            RawEdges::Plain(edges) => edges
+                .next()
+                .map(|(&target, &weight)| (target as usize, weight)),
+            RawEdges::Packed {
+                bytes,
+                target,
+                remaining,
+            } => {
+                if *remaining == 0 {
+                    return None;
+                }
+
+                *remaining -= 1;
+                *target += read_varint(bytes) as usize;
+                let weight = read_varint(bytes) as u32;
+
+                Some((*target, weight))
+            }
+        }
+    }
+}
+
+/// The edges of a single stage of a frozen graph in compressed sparse row form. The edges of the
+/// vertex with index `i` are stored at positions `offsets[i]..offsets[i + 1]` of `targets` and
+/// `weights`, sorted by target index. Edge lengths are products of S-box table entries and take
+/// few distinct values, so each edge only stores the index of its length in `lengths`.
+///
+/// The edges can also be packed, in which case `offsets`, `targets` and `weights` are empty.
+/// Instead, the edges of vertex `i` are stored at positions
+/// `packed_offsets[i]..packed_offsets[i + 1]` of `packed`, as a varint holding the degree of the
+/// vertex followed by pairs of varints. The first varint of each pair is the difference to the
+/// previous target index, and the second is the index of the length.
+#[derive(Clone, Debug, Default, PartialEq)]
+pub struct Adjacency {
+    num_edges: usize,
+    offsets: Vec<usize>,
+    targets: Vec<u32>,
+    weights: Vec<u32>,
+    packed_offsets: Vec<usize>,
+    packed: Vec<u8>,
+    lengths: Vec<f64>,
+}
+
+impl Adjacency {
+    /// Creates an adjacency structure from per-vertex edge lists.
+    fn from_lists(lists: Vec<Vec<(u32, f64)>>) -> Adjacency {
+        let num_edges = lists.iter().fold(0, |sum, l| sum + l.len());
+        let mut offsets = Vec::with_capacity(lists.len() + 1);
+        let mut targets = Vec::with_capacity(num_edges);
+        let mut weights = Vec::with_capacity(num_edges);
+        let mut lengths = Vec::new();
+        let mut length_index = FnvHashMap::default();
+
+        offsets.push(0);
+
+        for mut list in lists {
+            list.sort_by_key(|&(target, _)| target);
+
+            for (target, length) in list {
+                let weight = *length_index.entry(length.to_bits()).or_insert_with(|| {
+                    lengths.push(length);
+                    (lengths.len() - 1) as u32
+                });
+
+                targets.push(target);
+                weights.push(weight);
+            }
+
+            offsets.push(targets.len());
+        }
+
+        Adjacency {
+            num_edges,
+            offsets,
+            targets,
+            weights,
+            packed_offsets: Vec::new(),
+            packed: Vec::new(),
+            lengths,
+        }
+    }
+
+    /// Creates the transpose of an adjacency structure, i.e. with all edges reversed.
+    /// `num_targets` is the number of vertices in the stage the edges point to. The transpose
+    /// is packed if the original is.
+    fn transpose(&self, num_targets: usize) -> Adjacency {
+        // Count the number of edges into each target and find offsets
+        let mut offsets = vec![0; num_targets + 1];
+
+        for source in 0..self.num_sources() {
+            for (target, _) in self.raw_edges(source) {
+                offsets[target + 1] += 1;
+            }
+        }
+
+        for i in 0..num_targets {
+            offsets[i + 1] += offsets[i];
+        }
+
+        // Place edges. Sources are visited in increasing order, so each list stays sorted
+        let mut position = offsets.clone();
+        let mut targets = vec![0; self.num_edges()];
+        let mut weights = vec![0; self.num_edges()];
+
+        for source in 0..self.num_sources() {
+            for (target, weight) in self.raw_edges(source) {
+                targets[position[target]] = source as u32;
+                weights[position[target]] = weight;
+                position[target] += 1;
+            }
+        }
+
+        let transpose = Adjacency {
+            num_edges: self.num_edges(),
+            offsets,
+            targets,
+            weights,
+            packed_offsets: Vec::new(),
+            packed: Vec::new(),
+            lengths: self.lengths.clone(),
+        };
+
+        if self.is_packed() {
+            transpose.pack()
+        } else {
+            transpose
+        }
+    }
+
+    /// Returns a copy of the adjacency structure with packed edges. The offsets of the plain
+    /// edges are dropped, since the packed edges carry their own degree.
+    fn pack(&self) -> Adjacency {
+        let mut packed_offsets = Vec::with_capacity(self.num_sources() + 1);
+        let mut packed = Vec::new();
+
+        packed_offsets.push(0);
+
+        for source in 0..self.num_sources() {
+            let mut previous = 0;
+            write_varint(&mut packed, self.degree(source) as u64);
+
+            for (target, weight) in self.raw_edges(source) {
+                write_varint(&mut packed, (target - previous) as u64);
+                write_varint(&mut packed, u64::from(weight));
+                previous = target;
+            }
+
+            packed_offsets.push(packed.len());
+        }
+
+        packed.shrink_to_fit();
+
+        Adjacency {
+            num_edges: self.num_edges(),
+            offsets: Vec::new(),
+            targets: Vec::new(),
+            weights: Vec::new(),
+            packed_offsets,
+            packed,
+            lengths: self.lengths.clone(),
+        }
+    }
+
+    /// Check if the edges are packed.
+    fn is_packed(&self) -> bool {
+        !self.packed_offsets.is_empty()
+    }
+
+    /// Returns the number of bytes used to store the edges, including their offsets.
+    pub fn edge_bytes(&self) -> usize {
+        8 * (self.offsets.len() + self.packed_offsets.len())
+            + 4 * (self.targets.len() + self.weights.len())
+            + self.packed.len()
+    }
+
+    /// Writes the adjacency structure in a raw binary format.
+    fn write_to<W: Write>(&self, writer: &mut W) {
+        write_u64(writer, self.num_edges as u64);
+        write_u64(writer, self.offsets.len() as u64);
+        write_u64(writer, self.targets.len() as u64);
+        write_u64(writer, self.packed_offsets.len() as u64);
+        write_u64(writer, self.packed.len() as u64);
+        write_u64(writer, self.lengths.len() as u64);
+
+        for &x in self.offsets.iter().chain(&self.packed_offsets) {
+            write_u64(writer, x as u64);
+        }
+
+        for &x in self.targets.iter().chain(&self.weights) {
+            write_u32(writer, x);
+        }
+
+        writer
+            .write_all(&self.packed)
+            .expect("Could not write to file.");
+
+        for &x in &self.lengths {
+            write_u64(writer, x.to_bits());
+        }
+    }
+
+    /// Reads an adjacency structure written by `write_to`.
+    fn read_from<R: Read>(reader: &mut R) -> Adjacency {
+        let num_edges = read_u64(reader) as usize;
+        let num_offsets = read_u64(reader) as usize;
+        let num_targets = read_u64(reader) as usize;
+        let num_packed_offsets = read_u64(reader) as usize;
+        let num_packed = read_u64(reader) as usize;
+        let num_lengths = read_u64(reader) as usize;
+
+        let offsets = (0..num_offsets)
+            .map(|_| read_u64(reader) as usize)
+            .collect();
+        let packed_offsets = (0..num_packed_offsets)
+            .map(|_| read_u64(reader) as usize)
+            .collect();
+        let targets = (0..num_targets).map(|_| read_u32(reader)).collect();
+        let weights = (0..num_targets).map(|_| read_u32(reader)).collect();
+
+        let mut packed = vec![0; num_packed];
+        reader
+            .read_exact(&mut packed)
+            .expect("Could not read from file.");
+
+        let lengths = (0..num_lengths)
+            .map(|_| f64::from_bits(read_u64(reader)))
+            .collect();
+
+        Adjacency {
+            num_edges,
+            offsets,
+            targets,
+            weights,
+            packed_offsets,
+            packed,
+            lengths,
+        }
+    }
+
+    /// Writes the adjacency structure to a file.
+    fn write(&self, path: &Path) {
+        let mut file = BufWriter::new(File::create(path).expect("Could not create file."));
+        self.write_to(&mut file);
+        file.flush().expect("Could not write to file.");
+    }
+
+    /// Reads an adjacency structure from a file written by `write`.
+    fn read(path: &Path) -> Adjacency {
+        let mut file = BufReader::new(File::open(path).expect("Could not open file."));
+        Adjacency::read_from(&mut file)
+    }
+
+    /// Returns the number of vertices the edges start from.
+    pub fn num_sources(&self) -> usize {
+        if self.is_packed() {
+            self.packed_offsets.len() - 1
+        } else {
+            self.offsets.len().saturating_sub(1)
+        }
+    }
+
+    /// Returns the number of edges.
+    pub fn num_edges(&self) -> usize {
+        self.num_edges
+    }
+
+    /// Returns the packed edges of the vertex with index `source`, following its degree.
+    fn packed_edges(&self, source: usize) -> (usize, &[u8]) {
+        let mut bytes = &self.packed[self.packed_offsets[source]..self.packed_offsets[source + 1]];
+        let degree = read_varint(&mut bytes) as usize;
+
+        (degree, bytes)
+    }
+
+    /// Returns the number of edges starting from the vertex with index `source`.
+    pub fn degree(&self, source: usize) -> usize {
+        if self.is_packed() {
+            self.packed_edges(source).0
+        } else {
+            self.offsets[source + 1] - self.offsets[source]
+        }
+    }
+
+    /// Returns an iterator over the edges starting from the vertex with index `source`, given as
+    /// pairs of target index and index into the length table.
+    fn raw_edges(&self, source: usize) -> RawEdges<'_> {
+        if self.is_packed() {
+            let (remaining, bytes) = self.packed_edges(source);
+
+            RawEdges::Packed {
+                bytes,
+                target: 0,
+                remaining,
+            }
+        } else {
+            let range = self.offsets[source]..self.offsets[source + 1];
+            RawEdges::Plain(self.targets[range.clone()].iter().zip(&self.weights[range]))
+        }
+    }
+
+    /// Returns an iterator over the edges starting from the vertex with index `source`, given as
+    /// pairs of target index and length. Packed edges are decoded while iterating.
+    pub fn edges(&self, source: usize) -> impl Iterator<Item = (usize, f64)> + '_ {
+        self.raw_edges(source)
+            .map(move |(target, weight)| (target, self.lengths[weight as usize]))
+    }
+}
+
+/// The edges of a single stage of a frozen graph, kept either in memory or in a file.
+#[derive(Debug)]
+enum StageEdges {
+    Memory(Adjacency),
+    Disk { path: PathBuf, num_edges: usize },
+}
+
+impl StageEdges {
+    /// Returns the number of edges in the stage.
+    fn num_edges(&self) -> usize {
+        match self {
+            StageEdges::Memory(adjacency) => adjacency.num_edges(),
+            StageEdges::Disk { num_edges, .. } => *num_edges,
+        }
+    }
+
+    /// Returns the edges of the stage, reading them from disk if necessary.
+    fn load(&self) -> Cow<'_, Adjacency> {
+        match self {
+            StageEdges::Memory(adjacency) => Cow::Borrowed(adjacency),
+            StageEdges::Disk { path, .. } => Cow::Owned(Adjacency::read(path)),
+        }
+    }
+
+    /// Replaces the edges of the stage. Edges on disk are overwritten.
+    fn store(&mut self, adjacency: Adjacency) {
+        match self {
+            StageEdges::Memory(old) => *old = adjacency,
+            StageEdges::Disk { path, num_edges } => {
+                adjacency.write(path);
+                *num_edges = adjacency.num_edges();
+            }
+        }
+    }
+
+    /// Moves the edges of the stage to the given file.
+    fn spill(&mut self, path: PathBuf) {
+        if let StageEdges::Memory(adjacency) = self {
+            adjacency.write(&path);
+            *self = StageEdges::Disk {
+                path,
+                num_edges: adjacency.num_edges(),
+            };
+        }
+    }
+}
+
+impl Drop for StageEdges {
+    fn drop(&mut self) {
+        if let StageEdges::Disk { path, .. } = self {
+            // The file is only scratch space, so failing to remove it is not an error
+            let _ = fs::remove_file(path);
+        }
+    }
+}
+
+/// Returns the path of the file holding the edges of a stage of the graph with the given spill
+/// id. The process id keeps processes sharing a directory apart.
+fn spill_file(directory: &Path, spill_id: usize, stage: usize, direction: &str) -> PathBuf {
+    directory.join(format!(
+        "cryptagraph-{}-{}-{}-{}.edges",
+        std::process::id(),
+        spill_id,
+        direction,
+        stage
+    ))
+}
+
+/// A read-only multistage graph. The vertices of each stage are stored as a sorted array of
+/// labels, and edges refer to vertices by their index in these arrays. Compared to
+/// `MultistageGraph`, this takes up a fraction of the memory per edge. Edges indexed by head
+/// are only built on request, as most searches only traverse the graph forwards.
+///
+/// The edges of each stage can be spilled to disk, in which case they are read back one stage
+/// at a time by the functions working on the graph. The edges can also be packed to save
+/// further memory, in which case they are decoded while being iterated.
+#[derive(Debug)]
+pub struct FrozenGraph {
+    vertices: Vec<Vec<u128>>,
+    forward: Vec<StageEdges>,
+    backward: Option<Vec<StageEdges>>,
+    packed: bool,
+    stages: usize,
+    spill_id: usize,
+}
+
+impl FrozenGraph {
+    /// Creates a frozen copy of a multistage graph.
+    pub fn new(graph: &MultistageGraph) -> FrozenGraph {
+        let stages = graph.stages();
+
+        // Find the stages each vertex occurs in
+        let occurrences: Vec<_> = (0..graph.num_ids() as u32)
+            .map(|id| graph.vertex_stages(id))
+            .collect();
+
+        // Each stage holds pairs of labels and identifiers, sorted by label
+        let mut vertices = vec![Vec::new(); stages + 1];
+
+        for (id, occurrence) in occurrences.into_iter().enumerate() {
+            for (stage, stage_vertices) in vertices.iter_mut().enumerate() {
+                if (occurrence >> stage) & 0x1 == 1 {
+                    stage_vertices.push((graph.label(id as u32), id as u32));
+                }
+            }
+        }
+
+        for stage_vertices in &mut vertices {
+            stage_vertices.sort_unstable();
+        }
+
+        // Build the edges of each stage in parallel
+        let (result_tx, result_rx) = mpsc::channel();
+
+        crossbeam_utils::thread::scope(|scope| {
+            for t in 0..*THREADS {
+                let result_tx = result_tx.clone();
+                let vertices = &vertices;
+
+                scope.spawn(move |_| {
+                    for stage in (0..stages).skip(t).step_by(*THREADS) {
+                        let mut lists = vec![Vec::new(); vertices[stage].len()];
+
+                        for (&(_, tail), list) in vertices[stage].iter().zip(lists.iter_mut()) {
+                            for (&head, &(edges, length)) in &graph.forward_edges()[tail as usize] {
+                                if (edges >> stage) & 0x1 == 1 {
+                                    let target = vertices[stage + 1]
+                                        .binary_search(&(graph.label(head), head))
+                                        .expect("Head is missing from the next stage.");
+                                    list.push((target as u32, length));
+                                }
+                            }
+                        }
+
+                        result_tx
+                            .send((stage, Adjacency::from_lists(lists)))
+                            .expect("Thread could not send result");
+                    }
+                });
+            }
+        })
+        .expect("Threads failed to join.");
+
+        let mut forward = vec![Adjacency::default(); stages];
+
+        for _ in 0..stages {
+            let (stage, stage_forward) = result_rx.recv().expect("Main could not receive result");
+            forward[stage] = stage_forward;
+        }
+
+        let forward = forward.into_iter().map(StageEdges::Memory).collect();
+
+        // Only the labels are kept
+        let vertices = vertices
+            .into_iter()
+            .map(|stage_vertices| stage_vertices.into_iter().map(|(v, _)| v).collect())
+            .collect();
+
+        FrozenGraph {
+            vertices,
+            forward,
+            backward: None,
+            packed: false,
+            stages,
+            spill_id: 0,
+        }
+    }
+
+    /// Builds the edges indexed by head for all stages in parallel, unless they already exist.
+    /// If the graph is spilled, the new edges are spilled as well.
+    pub fn build_backward(&mut self) {
+        if self.backward.is_some() {
+            return;
+        }
+
+        if self.is_spilled() {
+            let mut backward = Vec::with_capacity(self.stages);
+
+            for stage in 0..self.stages {
+                let forward = self.load_forward_edges(stage);
+                let mut edges = StageEdges::Memory(forward.transpose(self.num_vertices(stage + 1)));
+                edges.spill(self.spill_path(stage, "backward"));
+                backward.push(edges);
+            }
+
+            self.backward = Some(backward);
+            return;
+        }
+
+        let (result_tx, result_rx) = mpsc::channel();
+        let stages = self.stages;
+        let graph = &(*self);
+
+        // Start scoped worker threads
+        crossbeam_utils::thread::scope(|scope| {
+            for t in 0..*THREADS {
+                let result_tx = result_tx.clone();
+
+                scope.spawn(move |_| {
+                    for stage in (0..stages).skip(t).step_by(*THREADS) {
+                        let backward = graph
+                            .forward_edges(stage)
+                            .transpose(graph.num_vertices(stage + 1));
+
+                        result_tx
+                            .send((stage, backward))
+                            .expect("Thread could not send result");
+                    }
+                });
+            }
+        })
+        .expect("Threads failed to join.");
+
+        let mut backward = vec![Adjacency::default(); stages];
+
+        for _ in 0..stages {
+            let (stage, stage_backward) = result_rx.recv().expect("Main could not receive result");
+            backward[stage] = stage_backward;
+        }
+
+        self.backward = Some(backward.into_iter().map(StageEdges::Memory).collect());
+    }
+
+    /// Returns the path of the file holding the edges of a spilled stage.
+    fn spill_path(&self, stage: usize, direction: &str) -> PathBuf {
+        let directory = match &self.forward[0] {
+            StageEdges::Disk { path, .. } => path.parent().expect("No parent directory."),
+            StageEdges::Memory(_) => panic!("Graph is not spilled."),
+        };
+
+        spill_file(directory, self.spill_id, stage, direction)
+    }
+
+    /// Moves the edges of all stages to files in the given directory, freeing the memory they
+    /// use. The files are removed again when the graph is dropped.
+    pub fn spill(&mut self, directory: &str) {
+        fs::create_dir_all(directory).expect("Could not create directory.");
+        let directory = Path::new(directory);
+
+        if !self.is_spilled() {
+            self.spill_id = NEXT_SPILL_ID.fetch_add(1, Ordering::Relaxed);
+        }
+
+        for (stage, edges) in self.forward.iter_mut().enumerate() {
+            edges.spill(spill_file(directory, self.spill_id, stage, "forward"));
+        }
+
+        if let Some(backward) = &mut self.backward {
+            for (stage, edges) in backward.iter_mut().enumerate() {
+                edges.spill(spill_file(directory, self.spill_id, stage, "backward"));
+            }
+        }
+    }
+
+    /// Packs the edges of all stages, reducing the memory they take up. Edges built later, e.g.
+    /// when pruning, are packed as well.
+    pub fn pack(&mut self) {
+        if self.packed {
+            return;
+        }
+
+        self.packed = true;
+
+        for edges in self
+            .forward
+            .iter_mut()
+            .chain(self.backward.iter_mut().flatten())
+        {
+            let adjacency = edges.load().pack();
+            edges.store(adjacency);
+        }
+    }
+
+    /// Returns the number of bytes used to store the edges of the graph.
+    pub fn edge_bytes(&self) -> usize {
+        self.forward
+            .iter()
+            .chain(self.backward.iter().flatten())
+            .fold(0, |sum, edges| sum + edges.load().edge_bytes())
+    }
+
+    /// Check if the edges indexed by head have been built.
+    pub fn has_backward(&self) -> bool {
+        self.backward.is_some()
+    }
+
+    /// Check if the edges of the graph are spilled to disk.
+    pub fn is_spilled(&self) -> bool {
+        match self.forward.first() {
+            Some(StageEdges::Disk { .. }) => true,
+            _ => false,
+        }
+    }
+
+    /// Writes the graph to a binary snapshot file. The snapshot records the cipher, property
+    /// type and number of stages the graph was generated for, followed by the vertex labels
+    /// and forward edges of each stage. Backward edges aren't stored.
+    pub fn save(&self, path: &str, cipher: &dyn Cipher, property_type: PropertyType) {
+        let mut file = BufWriter::new(File::create(path).expect("Could not create file."));
+        let name = cipher.name();
+
+        file.write_all(SNAPSHOT_MAGIC)
+            .expect("Could not write to file.");
+        write_u64(&mut file, SNAPSHOT_VERSION);
+        write_u64(&mut file, name.len() as u64);
+        file.write_all(name.as_bytes())
+            .expect("Could not write to file.");
+        write_u64(&mut file, property_type_id(property_type));
+        write_u64(&mut file, self.stages as u64);
+
+        for vertices in &self.vertices {
+            write_u64(&mut file, vertices.len() as u64);
+
+            for &v in vertices {
+                file.write_all(&v.to_le_bytes())
+                    .expect("Could not write to file.");
+            }
+        }
+
+        for stage in 0..self.stages {
+            self.load_forward_edges(stage).write_to(&mut file);
+        }
+
+        file.flush().expect("Could not write to file.");
+    }
+
+    /// Reads a graph from a snapshot file written by `save`.
+    ///
+    /// # Panics
+    /// Panics if the file isn't a snapshot of the current version, or if the graph was generated
+    /// for a different cipher, property type or number of rounds.
+    pub fn load(
+        path: &str,
+        cipher: &dyn Cipher,
+        property_type: PropertyType,
+        rounds: usize,
+    ) -> FrozenGraph {
+        let mut file = BufReader::new(File::open(path).expect("Could not open file."));
+
+        let mut magic = [0; 8];
+        file.read_exact(&mut magic)
+            .expect("Could not read from file.");
+
+        if &magic != SNAPSHOT_MAGIC {
+            panic!("File is not a graph snapshot.");
+        }
+
+        if read_u64(&mut file) != SNAPSHOT_VERSION {
+            panic!("Graph snapshot version is not supported.");
+        }
+
+        let mut name = vec![0; read_u64(&mut file) as usize];
+        file.read_exact(&mut name)
+            .expect("Could not read from file.");
+
+        if name != cipher.name().as_bytes() {
+            panic!("Graph snapshot was generated for a different cipher.");
+        }
+
+        if read_u64(&mut file) != property_type_id(property_type) {
+            panic!("Graph snapshot was generated for a different property type.");
+        }
+
+        let stages = read_u64(&mut file) as usize;
+
+        if stages != rounds {
+            panic!("Graph snapshot was generated for {} rounds.", stages);
+        }
+
+        let vertices = (0..=stages)
+            .map(|_| {
+                let num_vertices = read_u64(&mut file) as usize;
+
+                (0..num_vertices)
+                    .map(|_| {
+                        let mut buffer = [0; 16];
+                        file.read_exact(&mut buffer)
+                            .expect("Could not read from file.");
+                        u128::from_le_bytes(buffer)
+                    })
+                    .collect()
+            })
+            .collect();
+
+        let forward: Vec<_> = (0..stages)
+            .map(|_| StageEdges::Memory(Adjacency::read_from(&mut file)))
+            .collect();
+
+        let packed = match forward.first() {
+            Some(StageEdges::Memory(adjacency)) => adjacency.is_packed(),
+            _ => false,
+        };
+
+        FrozenGraph {
+            vertices,
+            forward,
+            backward: None,
+            packed,
+            stages,
+            spill_id: 0,
+        }
+    }
+
+    /// Get the number of stages.
+    pub fn stages(&self) -> usize {
+        self.stages
+    }
+
+    /// Returns the sorted labels of all vertices in a given stage.
+    pub fn vertices(&self, stage: usize) -> &[u128] {
+        &self.vertices[stage]
+    }
+
+    /// Returns the number of vertices in a given stage.
+    pub fn num_vertices(&self, stage: usize) -> usize {
+        self.vertices[stage].len()
+    }
+
+    /// Returns the index of the vertex v in the given stage, if it exists.
+    pub fn vertex_index(&self, v: u128, stage: usize) -> Option<usize> {
+        self.vertices[stage].binary_search(&v).ok()
+    }
+
+    /// Returns the number of edges in the graph.
+    pub fn num_edges(&self) -> usize {
+        self.forward.iter().fold(0, |e, a| e + a.num_edges())
+    }
+
+    /// Get the edges from vertices in `stage` to vertices in `stage + 1`, indexed by tail.
+    ///
+    /// # Panics
+    /// Panics if the graph is spilled. Use `load_forward_edges` instead.
+    pub fn forward_edges(&self, stage: usize) -> &Adjacency {
+        match &self.forward[stage] {
+            StageEdges::Memory(adjacency) => adjacency,
+            StageEdges::Disk { .. } => panic!("Stage is spilled to disk."),
+        }
+    }
+
+    /// Get the edges from vertices in `stage` to vertices in `stage + 1`, indexed by head.
+    ///
+    /// # Panics
+    /// Panics if the backward edges haven't been built with `build_backward`, or if the graph is
+    /// spilled. Use `load_backward_edges` instead.
+    pub fn backward_edges(&self, stage: usize) -> &Adjacency {
+        match &self
+            .backward
+            .as_ref()
+            .expect("Backward edges have not been built.")[stage]
+        {
+            StageEdges::Memory(adjacency) => adjacency,
+            StageEdges::Disk { .. } => panic!("Stage is spilled to disk."),
+        }
+    }
+
+    /// Get the edges from vertices in `stage` to vertices in `stage + 1`, indexed by tail.
+    /// The edges are read from disk if the graph is spilled.
+    pub fn load_forward_edges(&self, stage: usize) -> Cow<'_, Adjacency> {
+        self.forward[stage].load()
+    }
+
+    /// Get the edges from vertices in `stage` to vertices in `stage + 1`, indexed by head.
+    /// The edges are read from disk if the graph is spilled.
+    ///
+    /// # Panics
+    /// Panics if the backward edges haven't been built with `build_backward`.
+    pub fn load_backward_edges(&self, stage: usize) -> Cow<'_, Adjacency> {
+        self.backward
+            .as_ref()
+            .expect("Backward edges have not been built.")[stage]
+            .load()
+    }
+
+    /// Remove any edges that aren't part of a path from one of `inputs` in the first stage to
+    /// one of `outputs` in the last stage, as well as any vertices left without edges. If either
+    /// set isn't given, all vertices of that stage are allowed. The stages are visited one at a
+    /// time, so a spilled graph is streamed from disk.
+    pub fn restrict(
+        &mut self,
+        inputs: Option<&FnvHashSet<u128>>,
+        outputs: Option<&FnvHashSet<u128>>,
+    ) {
+        let stages = self.stages;
+        let allowed = |set: Option<&FnvHashSet<u128>>, stage: usize| -> Vec<bool> {
+            self.vertices[stage]
+                .iter()
+                .map(|vertex| set.map_or(true, |set| set.contains(vertex)))
+                .collect()
+        };
+
+        // Mark vertices reachable from the allowed inputs
+        let mut reachable: Vec<Vec<bool>> = Vec::with_capacity(stages + 1);
+        reachable.push(allowed(inputs, 0));
+
+        for stage in 0..stages {
+            let edges = self.load_forward_edges(stage);
+            let mut next = vec![false; self.num_vertices(stage + 1)];
+
+            for (tail, &alive) in reachable[stage].iter().enumerate() {
+                if alive {
+                    for (head, _) in edges.edges(tail) {
+                        next[head] = true;
+                    }
+                }
+            }
+
+            reachable.push(next);
+        }
+
+        // Mark vertices from which the allowed outputs can be reached
+        let mut coreachable: Vec<Vec<bool>> = vec![Vec::new(); stages + 1];
+        coreachable[stages] = allowed(outputs, stages);
+
+        for stage in (0..stages).rev() {
+            let edges = self.load_forward_edges(stage);
+            let next = &coreachable[stage + 1];
+            let previous = (0..self.num_vertices(stage))
+                .map(|tail| edges.edges(tail).any(|(head, _)| next[head]))
+                .collect();
+
+            coreachable[stage] = previous;
+        }
+
+        // A vertex survives if it is both reachable and coreachable. An edge survives if both its
+        // tail and head survive
+        let keep: Vec<Vec<bool>> = reachable
+            .iter()
+            .zip(coreachable.iter())
+            .map(|(r, c)| r.iter().zip(c.iter()).map(|(&r, &c)| r && c).collect())
+            .collect();
+
+        // Find new vertex indices
+        let mut new_index: Vec<Vec<Option<u32>>> = Vec::with_capacity(stages + 1);
+
+        for (stage, stage_keep) in keep.iter().enumerate() {
+            let mut next = 0;
+            let mut indices = Vec::with_capacity(stage_keep.len());
+            let mut vertices = Vec::new();
+
+            for (i, &k) in stage_keep.iter().enumerate() {
+                if k {
+                    indices.push(Some(next));
+                    vertices.push(self.vertices[stage][i]);
+                    next += 1;
+                } else {
+                    indices.push(None);
+                }
+            }
+
+            self.vertices[stage] = vertices;
+            new_index.push(indices);
+        }
+
+        // Rebuild edges
+        for stage in 0..stages {
+            let edges = self.forward[stage].load();
+            let mut lists = Vec::with_capacity(self.vertices[stage].len());
+
+            for tail in 0..keep[stage].len() {
+                if !keep[stage][tail] {
+                    continue;
+                }
+
+                let list: Vec<_> = edges
+                    .edges(tail)
+                    .filter_map(|(head, length)| new_index[stage + 1][head].map(|h| (h, length)))
+                    .collect();
+                lists.push(list);
+            }
+
+            let mut adjacency = Adjacency::from_lists(lists);
+
+            if self.packed {
+                adjacency = adjacency.pack();
+            }
+
+            drop(edges);
+            self.forward[stage].store(adjacency);
+        }
+
+        // Backward edges are rebuilt if they were in use
+        if self.backward.take().is_some() {
+            self.build_backward();
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::FrozenGraph;
+    use crate::cipher::name_to_cipher;
+    use crate::property::PropertyType;
+    use crate::search::graph::MultistageGraph;
+    use std::fs;
+
+    #[test]
+    fn unrestricted_matches_multistage_prune() {
+        let mut graph = MultistageGraph::new(3);
+        graph.add_edges(1, 2, 0b011, 0.5);
+        graph.add_edges(2, 3, 0b110, 0.25);
+        graph.add_edges(1, 4, 0b001, 0.125);
+        graph.add_edges(4, 5, 0b010, 0.5);
+        graph.add_edges(6, 2, 0b100, 1.0);
+
+        let mut frozen = FrozenGraph::new(&graph);
+        frozen.restrict(None, None);
+        graph.prune(0, 3);
+        let pruned = FrozenGraph::new(&graph);
+
+        assert_eq!(frozen.num_edges(), graph.num_edges());
+
+        for stage in 0..=3 {
+            assert_eq!(frozen.vertices(stage), pruned.vertices(stage));
+        }
+
+        for stage in 0..3 {
+            for tail in 0..frozen.num_vertices(stage) {
+                let a: Vec<_> = frozen.forward_edges(stage).edges(tail).collect();
+                let b: Vec<_> = pruned.forward_edges(stage).edges(tail).collect();
+                assert_eq!(a, b);
+            }
+        }
+    }
+
+    #[test]
+    fn restrict_keeps_allowed_paths() {
+        let mut graph = MultistageGraph::new(2);
+        graph.add_edges(1, 2, 0b01, 0.5);
+        graph.add_edges(2, 3, 0b10, 0.25);
+        graph.add_edges(2, 4, 0b10, 0.25);
+        graph.add_edges(5, 6, 0b01, 0.5);
+        graph.add_edges(6, 3, 0b10, 0.125);
+
+        let inputs = [1].iter().cloned().collect();
+        let outputs = [3].iter().cloned().collect();
+        let mut frozen = FrozenGraph::new(&graph);
+        frozen.restrict(Some(&inputs), Some(&outputs));
+
+        assert_eq!(frozen.num_edges(), 2);
+        assert_eq!(frozen.vertices(0), &[1]);
+        assert_eq!(frozen.vertices(1), &[2]);
+        assert_eq!(frozen.vertices(2), &[3]);
+    }
+
+    #[test]
+    fn spilled_restrict_matches_memory_restrict() {
+        let mut graph = MultistageGraph::new(3);
+        graph.add_edges(1, 2, 0b011, 0.5);
+        graph.add_edges(2, 3, 0b110, 0.25);
+        graph.add_edges(1, 4, 0b001, 0.125);
+        graph.add_edges(4, 5, 0b010, 0.5);
+        graph.add_edges(6, 2, 0b100, 1.0);
+
+        let inputs = [1, 6].iter().cloned().collect();
+        let mut memory = FrozenGraph::new(&graph);
+        memory.restrict(Some(&inputs), None);
+
+        let directory =
+            std::env::temp_dir().join(format!("cryptagraph-spill-test-{}", std::process::id()));
+        let mut spilled = FrozenGraph::new(&graph);
+        spilled.spill(directory.to_str().unwrap());
+        spilled.restrict(Some(&inputs), None);
+        assert!(spilled.is_spilled());
+        assert_eq!(spilled.num_edges(), memory.num_edges());
+
+        for stage in 0..3 {
+            assert_eq!(
+                *spilled.load_forward_edges(stage),
+                *memory.load_forward_edges(stage)
+            );
+        }
+
+        // Dropping the graph removes its files, leaving the directory empty
+        drop(spilled);
+        fs::remove_dir(&directory).expect("Spill files were not removed.");
+    }
+
+    #[test]
+    fn snapshot_round_trip() {
+        let mut graph = MultistageGraph::new(3);
+        graph.add_edges(1, 2, 0b011, 0.5);
+        graph.add_edges(2, 3, 0b110, 0.25);
+        graph.add_edges(6, 2, 0b100, 1.0);
+
+        let cipher = name_to_cipher("present").unwrap();
+        let path = std::env::temp_dir().join("cryptagraph-snapshot-test");
+        let path = path.to_str().unwrap();
+        let frozen = FrozenGraph::new(&graph);
+        frozen.save(path, cipher.as_ref(), PropertyType::Linear);
+        let loaded = FrozenGraph::load(path, cipher.as_ref(), PropertyType::Linear, 3);
+        std::fs::remove_file(path).unwrap();
+
+        for stage in 0..=3 {
+            assert_eq!(loaded.vertices(stage), frozen.vertices(stage));
+        }
+
+        for stage in 0..3 {
+            assert_eq!(loaded.forward_edges(stage), frozen.forward_edges(stage));
+        }
+    }
+
+    #[test]
+    fn packed_edges_match_plain_edges() {
+        let mut graph = MultistageGraph::new(2);
+
+        for i in 0..200 {
+            graph.add_edges(
+                i % 13,
+                (i * 7919) % 1000,
+                0b01,
+                1.0 / (1 + i % 13 % 5) as f64,
+            );
+            graph.add_edges((i * 7919) % 1000, 2000 + i % 300, 0b10, 0.5);
+        }
+
+        let mut plain = FrozenGraph::new(&graph);
+        let mut packed = FrozenGraph::new(&graph);
+        plain.build_backward();
+        packed.build_backward();
+        packed.pack();
+        assert!(4 * packed.edge_bytes() < 3 * plain.edge_bytes());
+
+        for stage in 0..2 {
+            let backward = plain
+                .forward_edges(stage)
+                .transpose(plain.num_vertices(stage + 1));
+
+            for tail in 0..plain.num_vertices(stage) {
+                let a: Vec<_> = plain.forward_edges(stage).edges(tail).collect();
+                let b: Vec<_> = packed.forward_edges(stage).edges(tail).collect();
+                assert_eq!(a, b);
+            }
+
+            for head in 0..plain.num_vertices(stage + 1) {
+                let a: Vec<_> = backward.edges(head).collect();
+                let b: Vec<_> = packed.backward_edges(stage).edges(head).collect();
+                assert_eq!(a, b);
+            }
+        }
+    }
+}
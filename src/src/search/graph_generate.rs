@@ -3,7 +3,6 @@
 
 use crossbeam_utils;
 use fnv::{FnvHashMap, FnvHashSet};
-use indexmap::IndexMap;
 use itertools::interleave;
 use num_cpus;
 use std::cmp;
@@ -12,9 +11,14 @@ use std::time::Instant;
 
 use crate::cipher::*;
 use crate::property::{MaskMap, PropertyFilter, PropertyType};
+use crate::search::checkpoint::Checkpoint;
+use crate::search::filter::BlockedBloom;
 use crate::search::graph::MultistageGraph;
+use crate::search::graph_builder::shard_builders;
+use crate::search::graph_frozen::FrozenGraph;
 use crate::search::prince_extra::prince_pruning_new;
 use crate::search::single_round::SortedProperties;
+use crate::search::striped_set::StripedSet;
 use crate::utility::{compress, ProgressBar};
 
 // The number of threads used for parallel calls is fixed
@@ -22,12 +26,41 @@ lazy_static! {
     static ref THREADS: usize = num_cpus::get();
 }
 
-/// Finds the set of all vertices that have both an input and an output.
+// Log2 of the number of anchors added if not specified
+const DEFAULT_ANCHORS: usize = 17;
+
+// Approximate memory used per edge of a MultistageGraph, including its backward index
+const EDGE_BYTES: f64 = 64.0;
+const GIB: f64 = (1u64 << 30) as f64;
+
+// The number of stripes of the concurrent sets used to find vertex sets in a single pass
+const STRIPES: usize = 256;
+
+/// Finds the set of all vertices that have both an input and an output. If `vertex_filter` is
+/// set, the inputs are kept in a Bloom filter rather than an exact set, so the vertex set may
+/// contain a few vertices without an input. These are removed when the graph is pruned. If
+/// `fused` is set, inputs and outputs are collected in a single pass by `fused_vertex_set`.
 fn get_vertex_set(
     properties: &SortedProperties,
     previous: Option<&FnvHashSet<u128>>,
     level: usize,
+    vertex_filter: bool,
+    fused: bool,
 ) -> FnvHashSet<u128> {
+    // The filter is sized for the number of inputs before compression, an upper bound
+    let filter = if vertex_filter {
+        let mut inputs = properties.clone();
+        inputs.set_type_input();
+        Some(BlockedBloom::new(inputs.len()))
+    } else {
+        None
+    };
+    let filter = filter.as_ref();
+
+    if fused {
+        return fused_vertex_set(properties, previous, level, filter);
+    }
+
     let (result_tx, result_rx) = mpsc::channel();
 
     // Start scoped worker threads
@@ -69,7 +102,12 @@ fn get_vertex_set(
                     }
 
                     let new = compress(property.input, level);
-                    input_set.insert(new);
+                    match filter {
+                        Some(filter) => filter.insert(new),
+                        None => {
+                            input_set.insert(new);
+                        }
+                    }
 
                     if t == 0 {
                         progress_bar.increment();
@@ -122,7 +160,12 @@ fn get_vertex_set(
 
                 for (property, _) in &thread_properties {
                     let new = compress(property.output, level);
-                    if input_set.contains(&new) {
+                    let found = match filter {
+                        Some(filter) => filter.contains(new),
+                        None => input_set.contains(&new),
+                    };
+
+                    if found {
                         union_set.insert(new);
                     }
 
@@ -150,6 +193,112 @@ fn get_vertex_set(
     vertex_set
 }
 
+/// Finds the same vertex set as `get_vertex_set` in a single parallel pass. Each thread
+/// enumerates the inputs and then the outputs of its patterns, inserting them into shared
+/// striped sets. The sets are then intersected stripe by stripe in parallel.
+fn fused_vertex_set(
+    properties: &SortedProperties,
+    previous: Option<&FnvHashSet<u128>>,
+    level: usize,
+    filter: Option<&BlockedBloom>,
+) -> FnvHashSet<u128> {
+    let input_set = StripedSet::new(STRIPES);
+    let output_set = StripedSet::new(STRIPES);
+
+    // Start scoped worker threads
+    crossbeam_utils::thread::scope(|scope| {
+        for t in 0..*THREADS {
+            let mut thread_properties = properties.clone();
+            let input_set = &input_set;
+            let output_set = &output_set;
+
+            scope.spawn(move |_| {
+                // Split the S-box patterns equally across threads
+                let tmp: Vec<_> = thread_properties
+                    .patterns()
+                    .iter()
+                    .cloned()
+                    .skip(t)
+                    .step_by(*THREADS)
+                    .collect();
+                thread_properties.set_patterns(&tmp);
+
+                let mut inputs = input_set.inserter();
+                let mut outputs = output_set.inserter();
+
+                thread_properties.set_type_input();
+                let num_input = thread_properties.len();
+                thread_properties.set_type_output();
+                let mut progress_bar = ProgressBar::new(num_input + thread_properties.len());
+
+                thread_properties.set_type_input();
+                for (property, _) in &thread_properties {
+                    if t == 0 {
+                        progress_bar.increment();
+                    }
+
+                    if let Some(previous) = previous {
+                        if !previous.contains(&compress(property.input, level - 1)) {
+                            continue;
+                        }
+                    }
+
+                    let new = compress(property.input, level);
+                    match filter {
+                        Some(filter) => filter.insert(new),
+                        None => inputs.insert(new),
+                    }
+                }
+
+                thread_properties.set_type_output();
+                for (property, _) in &thread_properties {
+                    outputs.insert(compress(property.output, level));
+
+                    if t == 0 {
+                        progress_bar.increment();
+                    }
+                }
+
+                inputs.finish();
+                outputs.finish();
+            });
+        }
+    })
+    .expect("Threads failed to join.");
+
+    let input_stripes = input_set.into_stripes();
+    let output_stripes = output_set.into_stripes();
+    let (result_tx, result_rx) = mpsc::channel();
+
+    // Intersect the stripes in parallel. Equal masks are in stripes with the same index
+    crossbeam_utils::thread::scope(|scope| {
+        for t in 0..*THREADS {
+            let input_stripes = &input_stripes;
+            let output_stripes = &output_stripes;
+            let result_tx = result_tx.clone();
+
+            scope.spawn(move |_| {
+                let mut vertices = Vec::new();
+
+                for i in (t..STRIPES).step_by(*THREADS) {
+                    vertices.extend(output_stripes[i].iter().filter(|&&x| match filter {
+                        Some(filter) => filter.contains(x),
+                        None => input_stripes[i].contains(&x),
+                    }));
+                }
+
+                result_tx
+                    .send(vertices)
+                    .expect("Thread could not send result");
+            });
+        }
+    })
+    .expect("Threads failed to join.");
+
+    drop(result_tx);
+    result_rx.iter().flatten().collect()
+}
+
 /// Generates a graph according to a set of properties and a stage pattern.
 fn gen_with_stages(
     properties: &SortedProperties,
@@ -162,10 +311,11 @@ fn gen_with_stages(
     // Block size of the compression
     let block = 1 << (3 - level);
     let (result_tx, result_rx) = mpsc::channel();
+    let builders = shard_builders(rounds, *THREADS);
 
     // Start scoped worker threads
     crossbeam_utils::thread::scope(|scope| {
-        for t in 0..*THREADS {
+        for (t, mut builder) in builders.into_iter().enumerate() {
             let mut thread_properties = properties.clone();
             let result_tx = result_tx.clone();
 
@@ -196,8 +346,7 @@ fn gen_with_stages(
                     .collect();
                 thread_properties.set_patterns(&tmp);
 
-                // Generate graph
-                let mut graph = MultistageGraph::new(rounds);
+                // Generate edges
                 let mut progress_bar = ProgressBar::new(thread_properties.len());
 
                 for (property, _) in &thread_properties {
@@ -234,9 +383,9 @@ fn gen_with_stages(
                                 ^ (1 << (rounds - 1));
                             let mask = input_mask & output_mask;
 
-                            graph.add_edges(input, output, stages & mask & previous_mask, length);
+                            builder.add_edges(input, output, stages & mask & previous_mask, length);
                         }
-                        None => graph.add_edges(input, output, stages & previous_mask, length),
+                        None => builder.add_edges(input, output, stages & previous_mask, length),
                     }
 
                     if t == 0 {
@@ -244,19 +393,17 @@ fn gen_with_stages(
                     }
                 }
 
-                result_tx.send(graph).expect("Thread could not send result");
+                result_tx
+                    .send(builder.finish())
+                    .expect("Thread could not send result");
             });
         }
     })
     .expect("Threads failed to join.");
 
     let mut graph = MultistageGraph::new(rounds);
-
-    // Find union of thread graphs
-    for _ in 0..*THREADS {
-        let mut thread_result = result_rx.recv().expect("Main could not receive result");
-        graph.union(&mut thread_result);
-    }
+    drop(result_tx);
+    graph.add_shards(result_rx.iter().collect());
 
     graph
 }
@@ -274,10 +421,11 @@ fn extend(
     // Block size of the compression
     let block = 1 << (3 - level);
     let (result_tx, result_rx) = mpsc::channel();
+    let builders = shard_builders(rounds, *THREADS);
 
     // Start scoped worker threads
     crossbeam_utils::thread::scope(|scope| {
-        for t in 0..*THREADS {
+        for (t, mut builder) in builders.into_iter().enumerate() {
             let mut thread_properties = properties.clone();
             let result_tx = result_tx.clone();
             let graph = &(*graph);
@@ -311,7 +459,6 @@ fn extend(
 
                 // Collect all edges that have corresponding output/input vertices in the
                 // second/second to last stage
-                let mut edges = IndexMap::new();
                 let mut progress_bar = ProgressBar::new(thread_properties.len());
 
                 for (property, _) in &thread_properties {
@@ -341,7 +488,7 @@ fn extend(
                     if stages != 0 {
                         let length = if level != 3 { 0.0 } else { property.value };
 
-                        edges.insert((input, output), (stages, length));
+                        builder.add_edges(input, output, stages, length);
                     }
 
                     if t == 0 {
@@ -349,20 +496,16 @@ fn extend(
                     }
                 }
 
-                result_tx.send(edges).expect("Thread could not send result");
+                result_tx
+                    .send(builder.finish())
+                    .expect("Thread could not send result");
             });
         }
     })
     .expect("Threads failed to join.");
 
-    // Add edges from each thread
-    for _ in 0..*THREADS {
-        let thread_result = result_rx.recv().expect("Main could not receive result");
-
-        for ((tail, head), (stages, length)) in thread_result {
-            graph.add_edges(tail, head, stages, length);
-        }
-    }
+    drop(result_tx);
+    graph.add_shards(result_rx.iter().collect());
 }
 
 /// Adds good edges from to/from each vertex in the second/second to last layer.
@@ -394,15 +537,16 @@ fn anchor_ends(
     let num_labels = start_labels.len() + end_labels.len();
     let max_anchors = match anchors {
         Some(x) => 1 << x,
-        None => 1 << 17,
+        None => 1 << DEFAULT_ANCHORS,
     };
     let limit = 0.max(max_anchors - (graph.num_vertices(0) + graph.num_vertices(rounds)) as i64);
     let num_anchor = (limit as f64 / num_labels as f64).ceil() as usize;
     println!("Adding {:?} anchors.", limit);
+    let builders = shard_builders(rounds, *THREADS);
 
     // Start scoped worker threads
     crossbeam_utils::thread::scope(|scope| {
-        for t in 0..*THREADS {
+        for (t, mut builder) in builders.into_iter().enumerate() {
             let result_tx = result_tx.clone();
             let mask_map = mask_map.clone();
             let start_labels = start_labels.clone();
@@ -413,7 +557,6 @@ fn anchor_ends(
                     start_labels.iter().skip(t).step_by(*THREADS).len()
                         + end_labels.iter().skip(t).step_by(*THREADS).len(),
                 );
-                let mut edges = IndexMap::new();
 
                 for (label, stage) in interleave(start_labels, end_labels)
                     .take(limit as usize)
@@ -428,10 +571,10 @@ fn anchor_ends(
                         for (input, value) in inputs {
                             if let Some(input_allowed) = input_allowed {
                                 if input_allowed.contains(&input) {
-                                    edges.insert((input, label, stage), value);
+                                    builder.add_edges(input, label, 1 << stage, value);
                                 }
                             } else {
-                                edges.insert((input, label, stage), value);
+                                builder.add_edges(input, label, 1 << stage, value);
                             }
                         }
                     } else {
@@ -443,10 +586,10 @@ fn anchor_ends(
 
                             if let Some(output_allowed) = output_allowed {
                                 if output_allowed.contains(&output) {
-                                    edges.insert((label, output, stage), value);
+                                    builder.add_edges(label, output, 1 << stage, value);
                                 }
                             } else {
-                                edges.insert((label, output, stage), value);
+                                builder.add_edges(label, output, 1 << stage, value);
                             }
                         }
                     }
@@ -456,20 +599,16 @@ fn anchor_ends(
                     }
                 }
 
-                result_tx.send(edges).expect("Thread could not send result");
+                result_tx
+                    .send(builder.finish())
+                    .expect("Thread could not send result");
             });
         }
     })
     .expect("Threads failed to join.");
 
-    // Add edges from each thread
-    for _ in 0..*THREADS {
-        let thread_result = result_rx.recv().expect("Main could not receive result");
-
-        for ((tail, head, stage), length) in thread_result {
-            graph.add_edges(tail, head, 1 << stage, length);
-        }
-    }
+    drop(result_tx);
+    graph.add_shards(result_rx.iter().collect());
 }
 
 /// Patches the graph, i.e. adds any missing edges between already existing vertices.
@@ -577,29 +716,8 @@ fn patch(cipher: &dyn Cipher, property_type: PropertyType, graph: &mut Multistag
     num_added
 }
 
-/// Creates a graph that represents a set of properties over a number of rounds for a
-/// given cipher.
-
-/// # Parameters
-/// * `cipher`: The cipher which the graph represents.
-/// * `property_type`: The type of the property the graph represents.
-/// * `rounds`: The number of cipher rounds. For Prince-like ciphers, this is the number of forward rounds.
-/// * `patterns`: Tje number of patterns to generate.
-/// * `anchors`: The number of anchors added in the input and output stages.
-/// * `allowed`: A set of allowed input-output pairs. Properties not matching these are filtered.
-pub fn generate_graph(
-    cipher: &dyn Cipher,
-    property_type: PropertyType,
-    rounds: usize,
-    patterns: usize,
-    anchors: Option<usize>,
-    allowed: &FnvHashSet<(u128, u128)>,
-) -> MultistageGraph {
-    // Generate the set of properties to consider
-    let mut properties =
-        SortedProperties::new(cipher, patterns, property_type, PropertyFilter::All);
-    let mut graph = MultistageGraph::new(rounds);
-
+/// Returns the number of properties, input properties and output properties considered.
+fn count_properties(properties: &mut SortedProperties) -> (usize, usize, usize) {
     properties.set_type_all();
     let num_prop = properties.len();
     properties.set_type_input();
@@ -607,184 +725,277 @@ pub fn generate_graph(
     properties.set_type_output();
     let num_output = properties.len();
 
-    // Change allowed inputs/outputs for Prince-like ciphers
-    let mut input_allowed: FnvHashSet<_> = allowed.iter().map(|(a, _)| *a).collect();
-    let mut output_allowed: FnvHashSet<_> = allowed.iter().map(|(_, b)| *b).collect();
-    if cipher.structure() == CipherStructure::Prince {
-        input_allowed = input_allowed.union(&output_allowed).cloned().collect();
-        output_allowed = FnvHashSet::default();
+    (num_prop, num_input, num_output)
+}
+
+/// The inputs and outputs allowed in the first and last stage of a graph. An empty set allows
+/// every value.
+struct AllowedEnds {
+    input: FnvHashSet<u128>,
+    output: FnvHashSet<u128>,
+}
+
+impl AllowedEnds {
+    /// Splits a set of allowed input-output pairs into allowed inputs and outputs. For
+    /// Prince-like ciphers, both inputs and outputs are allowed in the first stage.
+    fn new(cipher: &dyn Cipher, allowed: &FnvHashSet<(u128, u128)>) -> AllowedEnds {
+        let mut input: FnvHashSet<_> = allowed.iter().map(|(a, _)| *a).collect();
+        let mut output: FnvHashSet<_> = allowed.iter().map(|(_, b)| *b).collect();
+        if cipher.structure() == CipherStructure::Prince {
+            input = input.union(&output).cloned().collect();
+            output = FnvHashSet::default();
+        }
+
+        AllowedEnds { input, output }
     }
 
-    let input_allowed = if input_allowed.is_empty() {
-        None
-    } else {
-        Some(&input_allowed)
-    };
+    /// Returns the allowed inputs, or `None` if every input is allowed.
+    fn input(&self) -> Option<&FnvHashSet<u128>> {
+        Some(&self.input).filter(|input| !input.is_empty())
+    }
 
-    let output_allowed = if output_allowed.is_empty() {
-        None
-    } else {
-        Some(&output_allowed)
-    };
+    /// Returns the allowed outputs, or `None` if every output is allowed.
+    fn output(&self) -> Option<&FnvHashSet<u128>> {
+        Some(&self.output).filter(|output| !output.is_empty())
+    }
+}
+
+/// Caps the properties considered in the next level so that its graph is estimated to fit in
+/// `max_memory` bytes, given the expected number of edges per property. The patterns with the
+/// largest values are kept, and at least one pattern is always kept.
+fn limit_patterns(
+    properties: &mut SortedProperties,
+    max_memory: f64,
+    edges_per_property: f64,
+    level: usize,
+) {
+    let (num_prop, _, _) = count_properties(properties);
+    let estimate = num_prop as f64 * edges_per_property * EDGE_BYTES;
+    println!(
+        "Memory budget: level {} estimated at {:.2} GiB ({} properties, {:.3} edges each).",
+        level,
+        estimate / GIB,
+        num_prop,
+        edges_per_property
+    );
+
+    if estimate <= max_memory {
+        return;
+    }
+
+    let patterns_before = properties.len_patterns();
+    let max_properties = (max_memory / (edges_per_property * EDGE_BYTES)) as usize;
+    properties.limit_properties(max_properties);
+    properties.set_type_all();
+    println!(
+        "Memory budget: level {} now allows {} properties ({:.2} GiB).",
+        level,
+        max_properties,
+        max_memory / GIB
+    );
+    println!(
+        "Memory budget: dropped {} of {} patterns, keeping {} properties.",
+        patterns_before - properties.len_patterns(),
+        patterns_before,
+        properties.len()
+    );
+}
+
+/// Returns the number of anchors to add, such that the anchors are estimated to fit in
+/// `max_memory` bytes next to the edges already in the graph.
+fn limit_anchors(
+    graph: &MultistageGraph,
+    anchors: Option<usize>,
+    max_memory: f64,
+) -> Option<usize> {
+    let requested = anchors.unwrap_or(DEFAULT_ANCHORS);
+    let free = max_memory - graph.num_edges() as f64 * EDGE_BYTES;
+    let fit = (free / EDGE_BYTES).max(1.0).log2().floor() as usize;
+
+    if fit >= requested {
+        return anchors;
+    }
+
+    println!(
+        "Memory budget: {:.2} GiB left, reducing anchors from 2^{} to 2^{}.",
+        free.max(0.0) / GIB,
+        requested,
+        fit
+    );
+    Some(fit)
+}
+
+/// Generates the inner rounds of a graph over more than four rounds, i.e. a graph with
+/// `rounds - 2` stages. The compression is refined over three levels, and patterns which die
+/// along the way are removed from `properties`. If a checkpoint is given, the state is saved
+/// after each level, and with `options.resume`, generation continues after the last saved
+/// level. With a memory budget, the patterns kept for the next level are capped to fit it.
+fn generate_inner(
+    cipher: &dyn Cipher,
+    properties: &mut SortedProperties,
+    rounds: usize,
+    checkpoint: Option<&Checkpoint>,
+    options: &GenerateOptions,
+) -> MultistageGraph {
+    let GenerateOptions {
+        resume,
+        vertex_filter,
+        single_pass,
+        ..
+    } = *options;
+    let rounds = rounds - 2;
+    let mut graph = MultistageGraph::new(rounds);
+    let mut vertex_set = FnvHashSet::default();
+    let mut first_level = 1;
+    let mut edges_per_property: Option<f64> = None;
+
+    if let Some(saved) = checkpoint.filter(|_| resume).and_then(Checkpoint::load) {
+        println!("Resuming from checkpoint of level {}.\n", saved.level);
+        properties.set_patterns(&saved.patterns);
+        vertex_set = saved.vertex_set;
+        graph = saved.graph;
+        first_level = saved.level + 1;
+    }
+
+    // Iteratively generate graphs with finer compression functions
+    for level in first_level..4 {
+        // Get total number of properties considered
+        let (num_prop, num_input, num_output) = count_properties(properties);
+
+        println!(
+            "#### Level {}: {} properties ({} input, {} output). ####\n",
+            level, num_prop, num_input, num_output
+        );
+
+        // We take the previous graph into account when generating the new one
+        let old_graph = if level != 1 { Some(&graph) } else { None };
 
-    // Rounds 1 to 4 are treated specially
-    if rounds == 1 || rounds == 3 {
         let start = Instant::now();
+        println!("Finding vertex set.");
+        // Take the old vertex set into account if it exists
+        vertex_set = if level == 1 {
+            get_vertex_set(properties, None, level, vertex_filter, single_pass)
+        } else {
+            get_vertex_set(
+                properties,
+                Some(&vertex_set),
+                level,
+                vertex_filter,
+                single_pass,
+            )
+        };
         println!(
-            "Generating graph: {} properties ({} input, {} output).",
-            num_prop, num_input, num_output
+            "{} vertices in set [{:?} s]\n",
+            vertex_set.len(),
+            start.elapsed().as_secs()
+        );
+
+        // All but the first and last stage
+        let stages = ((1 << (rounds - 1)) - 1) ^ 1;
+
+        let start = Instant::now();
+        println!("Generating graph.");
+        graph = gen_with_stages(
+            properties,
+            rounds,
+            stages,
+            level,
+            Some(&vertex_set),
+            old_graph,
         );
-        graph = gen_with_stages(&properties, 1, 0b1, 3, None, None);
         println!(
-            "Graph has {} edges [{:?} s]\n",
+            "Graph has {} edges [{:?} s]",
             graph.num_edges(),
             start.elapsed().as_secs()
         );
-    } else {
-        if rounds == 2 {
-            let start = Instant::now();
-            println!("Generating graph.");
-            graph = gen_with_stages(&properties, 2, 0b11, 3, None, None);
-            println!(
-                "Graph has {} edges [{:?} s]\n",
-                graph.num_edges(),
-                start.elapsed().as_secs()
-            );
+        let mut peak_edges = graph.num_edges();
+
+        let start = Instant::now();
+        graph.prune(1, rounds - 1);
+        println!(
+            "Pruned graph has {} edges [{:?} s]\n",
+            graph.num_edges(),
+            start.elapsed().as_secs()
+        );
+
+        let start = Instant::now();
+        println!("Extending graph.");
+        extend(&mut graph, properties, rounds, level, None, None);
+        println!(
+            "Extended graph has {} edges [{:?} s]",
+            graph.num_edges(),
+            start.elapsed().as_secs()
+        );
+        peak_edges = cmp::max(peak_edges, graph.num_edges());
+
+        let start = Instant::now();
+        if cipher.structure() == CipherStructure::Prince {
+            prince_pruning_new(cipher, &mut graph);
+        } else {
+            graph.prune(0, rounds);
         }
+        println!(
+            "Pruned graph has {} edges [{:?} s]",
+            graph.num_edges(),
+            start.elapsed().as_secs()
+        );
 
-        if rounds == 4 {
-            println!(
-                "Finding vertex set: {} properties ({} input, {} output).",
-                num_prop, num_input, num_output
-            );
+        // Update filters and remove dead patterns if we havn't generated the final graph
+        if level != 3 {
             let start = Instant::now();
-            let vertex_set = get_vertex_set(&properties, None, 3);
+            println!("\nRemoving dead patterns.");
+            let patterns_before = properties.len_patterns();
+            properties.remove_dead_patterns(&graph, level);
+            let patterns_after = properties.len_patterns();
             println!(
-                "{} vertices in set [{:?} s]\n",
-                vertex_set.len(),
+                "Removed {} dead patterns [{:?} s]",
+                patterns_before - patterns_after,
                 start.elapsed().as_secs()
             );
 
+            // The next level only looks up forward edges in this graph
+            graph.release_backward();
+
+            if let Some(max_memory) = options.max_memory_bytes() {
+                // Extrapolate the growth in edges per property from the previous level, as the
+                // compression gets finer. A property gives at most one edge per stage
+                let ratio = peak_edges as f64 / num_prop as f64;
+                let growth = edges_per_property.map_or(1.0, |previous| (ratio / previous).max(1.0));
+                edges_per_property = Some(ratio);
+                let estimate = (ratio * growth).min(rounds as f64);
+
+                limit_patterns(properties, max_memory, estimate, level + 1);
+            }
+        }
+
+        if let Some(checkpoint) = checkpoint {
             let start = Instant::now();
-            println!("Generating graph.");
-            graph = gen_with_stages(&properties, 2, 0b11, 3, Some(&vertex_set), None);
+            checkpoint.save(level, &vertex_set, &graph, properties.patterns());
             println!(
-                "Graph has {} edges [{:?} s]\n",
-                graph.num_edges(),
+                "\nSaved checkpoint of level {} [{:?} s]",
+                level,
                 start.elapsed().as_secs()
             );
         }
 
-        if rounds > 4 {
-            // First generate the inner rounds
-            let rounds = rounds - 2;
-            graph = MultistageGraph::new(rounds);
-            let mut vertex_set = FnvHashSet::default();
-
-            // Iteratively generate graphs with finer compression functions
-            for level in 1..4 {
-                // Get total number of properties considered
-                properties.set_type_all();
-                let num_prop = properties.len();
-                properties.set_type_input();
-                let num_input = properties.len();
-                properties.set_type_output();
-                let num_output = properties.len();
-
-                println!(
-                    "#### Level {}: {} properties ({} input, {} output). ####\n",
-                    level, num_prop, num_input, num_output
-                );
-
-                // We take the previous graph into account when generating the new one
-                let old_graph = if level != 1 { Some(&graph) } else { None };
-
-                let start = Instant::now();
-                println!("Finding vertex set.");
-                // Take the old vertex set into account if it exists
-                vertex_set = if level == 1 {
-                    get_vertex_set(&properties, None, level)
-                } else {
-                    get_vertex_set(&properties, Some(&vertex_set), level)
-                };
-                println!(
-                    "{} vertices in set [{:?} s]\n",
-                    vertex_set.len(),
-                    start.elapsed().as_secs()
-                );
-
-                // All but the first and last stage
-                let stages = ((1 << (rounds - 1)) - 1) ^ 1;
-
-                let start = Instant::now();
-                println!("Generating graph.");
-                graph = gen_with_stages(
-                    &properties,
-                    rounds,
-                    stages,
-                    level,
-                    Some(&vertex_set),
-                    old_graph,
-                );
-                println!(
-                    "Graph has {} edges [{:?} s]",
-                    graph.num_edges(),
-                    start.elapsed().as_secs()
-                );
-
-                let start = Instant::now();
-                graph.prune(1, rounds - 1);
-                println!(
-                    "Pruned graph has {} edges [{:?} s]\n",
-                    graph.num_edges(),
-                    start.elapsed().as_secs()
-                );
-
-                let start = Instant::now();
-                println!("Extending graph.");
-                extend(&mut graph, &properties, rounds, level, None, None);
-                println!(
-                    "Extended graph has {} edges [{:?} s]",
-                    graph.num_edges(),
-                    start.elapsed().as_secs()
-                );
-
-                let start = Instant::now();
-                if cipher.structure() == CipherStructure::Prince {
-                    prince_pruning_new(cipher, &mut graph);
-                } else {
-                    graph.prune(0, rounds);
-                }
-                println!(
-                    "Pruned graph has {} edges [{:?} s]",
-                    graph.num_edges(),
-                    start.elapsed().as_secs()
-                );
-
-                // Update filters and remove dead patterns if we havn't generated the final graph
-                if level != 3 {
-                    let start = Instant::now();
-                    println!("\nRemoving dead patterns.");
-                    let patterns_before = properties.len_patterns();
-                    properties.remove_dead_patterns(&graph, level);
-                    let patterns_after = properties.len_patterns();
-                    println!(
-                        "Removed {} dead patterns [{:?} s]",
-                        patterns_before - patterns_after,
-                        start.elapsed().as_secs()
-                    );
-                }
-
-                println!();
-            }
-        }
+        println!();
     }
 
-    println!(
-        "#### Final steps: {} properties ({} input, {} output). ####\n",
-        num_prop, num_input, num_output
-    );
+    graph
+}
 
+/// Turns a graph of inner rounds into a graph over `rounds` rounds by extending, anchoring,
+/// pruning and patching it. With a memory budget, the number of anchors is capped to fit it.
+/// The finished graph is returned in frozen form.
+fn finish_graph(
+    cipher: &dyn Cipher,
+    property_type: PropertyType,
+    properties: &SortedProperties,
+    mut graph: MultistageGraph,
+    rounds: usize,
+    ends: &AllowedEnds,
+    options: &GenerateOptions,
+) -> FrozenGraph {
     // Extending
     if rounds > 2 {
         graph.insert_stage_before();
@@ -794,11 +1005,11 @@ pub fn generate_graph(
         println!("Extending final graph.");
         extend(
             &mut graph,
-            &properties,
+            properties,
             rounds,
             3,
-            input_allowed,
-            output_allowed,
+            ends.input(),
+            ends.output(),
         );
         println!(
             "Extended graph has {} edges [{:?} s]\n",
@@ -809,6 +1020,11 @@ pub fn generate_graph(
 
     // Anchoring
     if rounds > 1 && cipher.structure() != CipherStructure::Feistel {
+        let anchors = match options.max_memory_bytes() {
+            Some(max_memory) => limit_anchors(&graph, options.anchors, max_memory),
+            None => options.anchors,
+        };
+
         let start = Instant::now();
         print!("Anchoring final graph: ");
         anchor_ends(
@@ -816,8 +1032,8 @@ pub fn generate_graph(
             property_type,
             &mut graph,
             anchors,
-            input_allowed,
-            output_allowed,
+            ends.input(),
+            ends.output(),
         );
         println!(
             "Anchored graph has {} edges [{:?} s]",
@@ -838,6 +1054,9 @@ pub fn generate_graph(
         start.elapsed().as_secs()
     );
 
+    // Neither patching nor freezing uses the backward edges
+    graph.release_backward();
+
     // Patch graph
     if cipher.structure() != CipherStructure::Feistel {
         let start = Instant::now();
@@ -852,5 +1071,306 @@ pub fn generate_graph(
 
     println!("Final graph has {} edges\n", graph.num_edges());
 
+    graph.freeze()
+}
+
+/// Returns the single-round edge relation of a graph, i.e. every edge present in any stage.
+fn single_round_relation(graph: &MultistageGraph) -> Vec<(u128, u128, f64)> {
     graph
+        .forward_edges()
+        .iter()
+        .enumerate()
+        .flat_map(|(tail, heads)| {
+            heads
+                .iter()
+                .filter(|(_, &(stages, _))| stages != 0)
+                .map(move |(&head, &(_, length))| (tail as u32, head, length))
+        })
+        .map(|(tail, head, length)| (graph.label(tail), graph.label(head), length))
+        .collect()
+}
+
+/// Options for generating a graph, as given on the command line.
+#[derive(Clone, Debug, Default)]
+pub struct GenerateOptions {
+    /// The number of patterns to generate.
+    pub patterns: usize,
+    /// The number of anchors added in the input and output stages.
+    pub anchors: Option<usize>,
+    /// File to which the state is saved after each compression level.
+    pub checkpoint: Option<String>,
+    /// Whether to continue after the level saved in `checkpoint`, if any.
+    pub resume: bool,
+    /// Memory budget in GiB, to which the patterns and anchors are adapted.
+    pub max_memory: Option<f64>,
+    /// Whether to find vertex sets using a Bloom filter for the inputs.
+    pub vertex_filter: bool,
+    /// Whether to collect the inputs and outputs of vertex sets in a single pass.
+    pub single_pass: bool,
+}
+
+impl GenerateOptions {
+    /// Returns the memory budget in bytes, if any.
+    pub fn max_memory_bytes(&self) -> Option<f64> {
+        self.max_memory.map(|gib| gib * GIB)
+    }
+}
+
+/// Creates a graph that represents a set of properties over a number of rounds for a
+/// given cipher. The finished graph is returned in frozen form.
+
+/// # Parameters
+/// * `cipher`: The cipher which the graph represents.
+/// * `property_type`: The type of the property the graph represents.
+/// * `rounds`: The number of cipher rounds. For Prince-like ciphers, this is the number of forward rounds.
+/// * `allowed`: A set of allowed input-output pairs. Properties not matching these are filtered.
+/// * `options`: The patterns, anchors and other generation options.
+pub fn generate_graph(
+    cipher: &dyn Cipher,
+    property_type: PropertyType,
+    rounds: usize,
+    allowed: &FnvHashSet<(u128, u128)>,
+    options: &GenerateOptions,
+) -> FrozenGraph {
+    let GenerateOptions {
+        patterns,
+        ref checkpoint,
+        vertex_filter,
+        single_pass,
+        ..
+    } = *options;
+
+    // Generate the set of properties to consider
+    let mut properties =
+        SortedProperties::new(cipher, patterns, property_type, PropertyFilter::All);
+    let mut graph = MultistageGraph::new(rounds);
+    let (num_prop, num_input, num_output) = count_properties(&mut properties);
+
+    // Change allowed inputs/outputs for Prince-like ciphers
+    let ends = AllowedEnds::new(cipher, allowed);
+
+    // Rounds 1 to 4 are treated specially
+    if rounds == 1 || rounds == 3 {
+        let start = Instant::now();
+        println!(
+            "Generating graph: {} properties ({} input, {} output).",
+            num_prop, num_input, num_output
+        );
+        graph = gen_with_stages(&properties, 1, 0b1, 3, None, None);
+        println!(
+            "Graph has {} edges [{:?} s]\n",
+            graph.num_edges(),
+            start.elapsed().as_secs()
+        );
+    } else {
+        if rounds == 2 {
+            let start = Instant::now();
+            println!("Generating graph.");
+            graph = gen_with_stages(&properties, 2, 0b11, 3, None, None);
+            println!(
+                "Graph has {} edges [{:?} s]\n",
+                graph.num_edges(),
+                start.elapsed().as_secs()
+            );
+        }
+
+        if rounds == 4 {
+            println!(
+                "Finding vertex set: {} properties ({} input, {} output).",
+                num_prop, num_input, num_output
+            );
+            let start = Instant::now();
+            let vertex_set = get_vertex_set(&properties, None, 3, vertex_filter, single_pass);
+            println!(
+                "{} vertices in set [{:?} s]\n",
+                vertex_set.len(),
+                start.elapsed().as_secs()
+            );
+
+            let start = Instant::now();
+            println!("Generating graph.");
+            graph = gen_with_stages(&properties, 2, 0b11, 3, Some(&vertex_set), None);
+            println!(
+                "Graph has {} edges [{:?} s]\n",
+                graph.num_edges(),
+                start.elapsed().as_secs()
+            );
+        }
+
+        if rounds > 4 {
+            // First generate the inner rounds
+            let checkpoint = checkpoint
+                .as_ref()
+                .map(|path| Checkpoint::new(path, cipher, property_type, rounds, patterns));
+            graph = generate_inner(
+                cipher,
+                &mut properties,
+                rounds,
+                checkpoint.as_ref(),
+                options,
+            );
+        }
+    }
+
+    println!(
+        "#### Final steps: {} properties ({} input, {} output). ####\n",
+        num_prop, num_input, num_output
+    );
+
+    finish_graph(
+        cipher,
+        property_type,
+        &properties,
+        graph,
+        rounds,
+        &ends,
+        options,
+    )
+}
+
+/// Creates graphs for every number of rounds in `first..=last` and passes each of them to
+/// `search` in increasing order of rounds. Round counts above four share their inner rounds:
+/// the single-round edge relation is generated once, for the smallest such count, and the inner
+/// graph is then grown by one stage per round. Patterns and vertex sets are therefore those of
+/// the smallest count, and larger counts may keep slightly more edges than a standalone run.
+///
+/// # Parameters
+/// * `cipher`: The cipher which the graphs represent.
+/// * `property_type`: The type of the property the graphs represent.
+/// * `first`: The smallest number of cipher rounds.
+/// * `last`: The largest number of cipher rounds.
+/// * `allowed`: A set of allowed input-output pairs. Properties not matching these are filtered.
+/// * `options`: The generation options. Only the shared inner rounds are checkpointed.
+/// * `search`: Called with the number of rounds and the finished graph for each round count.
+pub fn sweep_graphs<F>(
+    cipher: &dyn Cipher,
+    property_type: PropertyType,
+    first: usize,
+    last: usize,
+    allowed: &FnvHashSet<(u128, u128)>,
+    options: &GenerateOptions,
+    mut search: F,
+) where
+    F: FnMut(usize, FrozenGraph),
+{
+    let GenerateOptions {
+        patterns,
+        ref checkpoint,
+        ..
+    } = *options;
+
+    // Graphs over up to four rounds have no inner rounds to share
+    let shared = cmp::max(first, 5);
+    let standalone = GenerateOptions {
+        checkpoint: None,
+        resume: false,
+        ..options.clone()
+    };
+
+    for rounds in first..cmp::min(shared, last + 1) {
+        println!("#### Sweep: {} rounds. ####\n", rounds);
+        let graph = generate_graph(cipher, property_type, rounds, allowed, &standalone);
+        search(rounds, graph);
+    }
+
+    if shared > last {
+        return;
+    }
+
+    let mut properties =
+        SortedProperties::new(cipher, patterns, property_type, PropertyFilter::All);
+    let ends = AllowedEnds::new(cipher, allowed);
+
+    println!("#### Sweep: {} rounds. ####\n", shared);
+    let checkpoint = checkpoint
+        .as_ref()
+        .map(|path| Checkpoint::new(path, cipher, property_type, shared, patterns));
+    let inner = generate_inner(
+        cipher,
+        &mut properties,
+        shared,
+        checkpoint.as_ref(),
+        options,
+    );
+    let relation = if last > shared {
+        single_round_relation(&inner)
+    } else {
+        Vec::new()
+    };
+
+    let (num_prop, num_input, num_output) = count_properties(&mut properties);
+    println!(
+        "#### Final steps: {} properties ({} input, {} output). ####\n",
+        num_prop, num_input, num_output
+    );
+
+    let graph = finish_graph(
+        cipher,
+        property_type,
+        &properties,
+        inner,
+        shared,
+        &ends,
+        options,
+    );
+    search(shared, graph);
+
+    if last == shared {
+        return;
+    }
+
+    // Adds the relation to a stage of the grown graph, leaving out edges whose tails can't be
+    // reached from the first stage
+    let add_stage = |grown: &mut MultistageGraph, stage: usize| {
+        for &(tail, head, length) in &relation {
+            if stage == 0 || grown.has_vertex_incoming(tail, stage) {
+                grown.add_edges(tail, head, 1 << stage, length);
+            }
+        }
+    };
+
+    // The grown graph is pruned in place. A path to the end of a later stage passes through the
+    // end of the current last stage, so no pruned edge is needed again once stages are appended
+    let mut grown = MultistageGraph::new(shared - 2);
+    for stage in 0..shared - 2 {
+        add_stage(&mut grown, stage);
+    }
+
+    for rounds in shared + 1..=last {
+        println!("#### Sweep: {} rounds. ####\n", rounds);
+        let start = Instant::now();
+        let stage = grown.stages();
+        grown.insert_stage_after();
+        add_stage(&mut grown, stage);
+        grown.prune(0, rounds - 2);
+
+        // Finishing consumes the inner graph, so only the last round can take the grown graph
+        let mut inner = if rounds == last {
+            std::mem::replace(&mut grown, MultistageGraph::new(0))
+        } else {
+            grown.clone()
+        };
+
+        // The reflection of Prince-like ciphers depends on the last stage, so it is only applied
+        // to the copy
+        if cipher.structure() == CipherStructure::Prince {
+            prince_pruning_new(cipher, &mut inner);
+        }
+        println!(
+            "Grown inner graph has {} edges [{:?} s]\n",
+            inner.num_edges(),
+            start.elapsed().as_secs()
+        );
+
+        let graph = finish_graph(
+            cipher,
+            property_type,
+            &properties,
+            inner,
+            rounds,
+            &ends,
+            options,
+        );
+        search(rounds, graph);
+    }
 }
@@ -1,9 +1,16 @@
 //! Types and functions for searching for properties of a cipher.
 
+pub mod aggregate;
+pub mod checkpoint;
+pub mod export;
+pub mod filter;
 pub mod find_properties;
 pub mod graph;
+pub mod graph_builder;
+pub mod graph_frozen;
 pub mod graph_generate;
 pub mod patterns;
 pub mod prince_extra;
 pub mod search_properties;
 pub mod single_round;
+pub mod striped_set;
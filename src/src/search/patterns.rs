@@ -199,6 +199,34 @@ impl SboxPattern {
         }
     }
 
+    /// Creates a pattern from the indices and values of its active S-boxes and its value, as
+    /// returned by `active` and `value`.
+    pub fn from_active(cipher: &dyn Cipher, active: &[(usize, i16)], value: f64) -> SboxPattern {
+        let pattern: Vec<_> = active
+            .iter()
+            .map(|&(i, x)| (cipher.sbox_pos_in(i), cipher.sbox_pos_out(i), i, x))
+            .collect();
+
+        SboxPattern {
+            counter: vec![0; pattern.len()],
+            pattern,
+            property: Property::new(0, 0, value, 1),
+            mask_in: cipher.sbox(0).mask_in() as u128,
+            mask_out: cipher.sbox(0).mask_out() as u128,
+            status: PatternStatus::New,
+        }
+    }
+
+    /// Returns the indices and values of the active S-boxes of the pattern.
+    pub fn active(&self) -> Vec<(usize, i16)> {
+        self.pattern.iter().map(|&(_, _, i, x)| (i, x)).collect()
+    }
+
+    /// Returns the value of the properties described by the pattern.
+    pub fn value(&self) -> f64 {
+        self.property.value
+    }
+
     /// Generate the next property matching the S-box pattern.
     pub fn next(
         &mut self,
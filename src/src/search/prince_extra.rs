@@ -14,23 +14,25 @@ pub fn prince_pruning_new(cipher: &dyn Cipher, graph: &mut MultistageGraph) {
     while pruned {
         pruned = false;
 
+        // Reflections are stored by identifier. Reflections which aren't vertices of the graph
+        // can't match any head
         let reflections: FnvHashSet<_> = graph
             .get_vertices_incoming(num_stages)
             .iter()
-            .map(|&x| cipher.reflection_layer(x as u128))
+            .filter_map(|&x| graph.vertex_id(cipher.reflection_layer(x as u128)))
             .collect();
         let mut remove = Vec::new();
 
-        for (&tail, heads) in graph.forward_edges() {
+        for (tail, heads) in graph.forward_edges().iter().enumerate() {
             for (&head, (stages, _)) in heads {
                 if ((stages >> (num_stages - 1)) & 0x1) == 1 && !reflections.contains(&head) {
-                    remove.push((tail, head, 1 << (num_stages - 1)));
+                    remove.push((tail as u32, head, 1 << (num_stages - 1)));
                 }
             }
         }
 
         for (tail, head, stages) in remove {
-            graph.remove_edges(tail, head, stages);
+            graph.remove_edges_by_id(tail, head, stages);
             pruned = true;
         }
 
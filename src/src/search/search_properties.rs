@@ -5,14 +5,16 @@ use std::fs::{File, OpenOptions};
 use std::io::{BufRead, BufReader, Write};
 use std::time::Instant;
 
-use crate::cipher::Cipher;
+use crate::cipher::{Cipher, CipherStructure};
 use crate::property::{Property, PropertyType};
-use crate::search::find_properties::parallel_find_properties;
-use crate::search::graph::MultistageGraph;
-use crate::search::graph_generate::generate_graph;
+use crate::search::aggregate::{Aggregation, Reducer};
+use crate::search::export::Export;
+use crate::search::find_properties::{parallel_find_properties, FindOptions};
+use crate::search::graph_frozen::FrozenGraph;
+use crate::search::graph_generate::{generate_graph, sweep_graphs, GenerateOptions};
 
 /// Dumps a graph to file for plotting with python graph-tool.
-fn dump_to_graph_tool(graph: &MultistageGraph, path: &str) {
+fn dump_to_graph_tool(graph: &FrozenGraph, path: &str) {
     let mut path = path.to_string();
     path.push_str(".graph");
 
@@ -24,29 +26,31 @@ fn dump_to_graph_tool(graph: &MultistageGraph, path: &str) {
         .open(path)
         .expect("Could not open file.");
 
-    let stages = graph.stages();
+    for i in 0..graph.stages() {
+        let tails = graph.vertices(i);
+        let heads = graph.vertices(i + 1);
 
-    for (tail, heads) in graph.forward_edges() {
-        for (head, (edges, _)) in heads {
-            for i in 0..stages {
-                if (edges >> i) & 0x1 == 1 {
-                    writeln!(file, "{},{},{},{}", i, tail, i + 1, head)
-                        .expect("Could not write to file.");
-                }
+        let edges = graph.load_forward_edges(i);
+
+        for (t, tail) in tails.iter().enumerate() {
+            for (h, _) in edges.edges(t) {
+                writeln!(file, "{},{},{},{}", i, tail, i + 1, heads[h])
+                    .expect("Could not write to file.");
             }
         }
     }
 }
 
 /// Dumps all vertices of a graph to the file <file_mask_out>.set.
-fn dump_masks(graph: &MultistageGraph, file_mask_out: &str) {
+fn dump_masks(graph: &FrozenGraph, file_mask_out: &str) {
     let mut file_set_path = file_mask_out.to_string();
     file_set_path.push_str(".set");
 
     // Collect edges and vertices
     let mut mask_set = FnvHashSet::<u128>::default();
-    mask_set.extend(graph.forward_edges().keys());
-    mask_set.extend(graph.backward_edges().keys());
+    for i in 0..=graph.stages() {
+        mask_set.extend(graph.vertices(i));
+    }
 
     // Contents of previous files are overwritten
     let mut file = OpenOptions::new()
@@ -106,39 +110,108 @@ fn read_allowed(file_mask_in: &str) -> FnvHashSet<(u128, u128)> {
     allowed
 }
 
+/// Options for searching a graph for properties, as given on the command line.
+#[derive(Clone, Debug, Default)]
+pub struct SearchOptions {
+    /// Prefix of two files which restict the input/output values of the properties.
+    pub file_mask_in: Option<String>,
+    /// Prefix of two files to which results are dumped.
+    pub file_mask_out: Option<String>,
+    /// The number of best properties to keep and dump.
+    pub num_keep: Option<usize>,
+    /// Prefix of a file to which raw graph data is dumped.
+    pub file_graph: Option<String>,
+    /// Directory in which the edges of the finished graph are stored during the search.
+    pub spill_dir: Option<String>,
+    /// File to which a snapshot of the generated graph is saved.
+    pub save_graph: Option<String>,
+    /// File from which a graph snapshot is loaded instead of generating the graph.
+    pub load_graph: Option<String>,
+    /// Whether to pack the edges of the graph before the search.
+    pub pack_graph: bool,
+    /// Whether to evaluate only the allowed pairs by meeting in the middle.
+    pub meet_in_middle: bool,
+    /// Whether to combine forward hulls through the reflection for Prince-like ciphers.
+    pub half_graph: bool,
+    /// Log2 of the smallest property value of interest.
+    pub threshold: Option<f64>,
+    /// Whether to reduce the graph to paths between allowed inputs and outputs.
+    pub targeted: bool,
+    /// Log2 of the smallest value of properties streamed to <file_mask_out>.export.*.
+    pub export: Option<f64>,
+    /// Whether exported properties are written in binary.
+    pub export_binary: bool,
+    /// How to group properties when summing their values to <file_mask_out>.agg.
+    pub aggregate: Option<String>,
+    /// Hexadecimal mask spanning the input subspace for the "subspace" aggregation.
+    pub subspace: Option<String>,
+    /// If provided, every number of rounds from `rounds` to `rounds_max` is searched.
+    pub rounds_max: Option<usize>,
+}
+
 /// Searches for properties over a given number of rounds for a given cipher.
 ///
 /// # Parameters
 /// * `cipher`: The cipher to investigate.
 /// * `property_type`: The type of property to search for.
 /// * `rounds`: The number of rounds to consider.
-/// * `patterns`: The number of S-box patterns to generate. Relates to the number of properties generate per round.
-/// * `file_mask_in`: Prefix of two files which restict the input/output values of the properties.
-/// * `file_mask_out`: Prefix of two files to which results are dumped.
-/// * `file_graph`: Prefix of a file to which raw graph data is dumped.
-#[cfg_attr(clippy, allow(too_many_arguments))]
+/// * `options`: Options for searching the graph and for the files read and written.
+/// * `generate`: Options for generating the graph.
 pub fn search_properties(
     cipher: &dyn Cipher,
     property_type: PropertyType,
     rounds: usize,
-    patterns: usize,
-    anchors: Option<usize>,
-    file_mask_in: Option<String>,
-    file_mask_out: Option<String>,
-    num_keep: Option<usize>,
-    file_graph: Option<String>,
+    options: &SearchOptions,
+    generate: &GenerateOptions,
 ) {
+    let SearchOptions {
+        ref file_mask_in,
+        ref file_mask_out,
+        num_keep,
+        ref file_graph,
+        ref spill_dir,
+        ref save_graph,
+        ref load_graph,
+        pack_graph,
+        meet_in_middle,
+        half_graph,
+        threshold,
+        targeted,
+        export,
+        export_binary,
+        ref aggregate,
+        ref subspace,
+        rounds_max,
+    } = *options;
+    let GenerateOptions {
+        patterns,
+        anchors,
+        ref checkpoint,
+        resume,
+        max_memory,
+        ..
+    } = *generate;
+
     println!("\tCipher: {}.", cipher.name());
     match property_type {
         PropertyType::Linear => println!("\tProperty: Linear"),
         PropertyType::Differential => println!("\tProperty: Differential"),
     }
-    println!("\tRounds: {}.", rounds);
+    match rounds_max {
+        Some(r) => println!("\tRounds: {} to {}.", rounds, r),
+        None => println!("\tRounds: {}.", rounds),
+    }
     println!("\tS-box patterns: {}", patterns);
     match anchors {
         Some(a) => println!("\tMaximum anchors: 2^{}", a),
         None => println!("\tMaximum anchors: 2^17"),
     }
+    if let Some(t) = threshold {
+        println!("\tThreshold: 2^{}", t);
+    }
+    if let Some(m) = max_memory {
+        println!("\tMemory budget: {} GiB", m);
+    }
     println!();
 
     let start = Instant::now();
@@ -153,43 +226,188 @@ pub fn search_properties(
         None => FnvHashSet::default(),
     };
 
+    if resume && checkpoint.is_none() {
+        panic!("Resuming requires <checkpoint>.");
+    }
+
+    if rounds_max.is_some() && load_graph.is_some() {
+        panic!("Round sweeps generate their graphs and cannot load a snapshot.");
+    }
+
+    // Check the options used after generation here, so that mistakes don't cost a generation
+    let export = export.map(|value| {
+        let path = file_mask_out
+            .as_ref()
+            .expect("Exporting properties requires <file_mask_out>.");
+        (path, value.exp2())
+    });
+
+    let reducer = aggregate.as_ref().map(|name| {
+        file_mask_out
+            .as_ref()
+            .expect("Aggregating properties requires <file_mask_out>.");
+
+        match name.as_str() {
+            "output" => Reducer::Output,
+            "input" => Reducer::Input,
+            "subspace" => {
+                let mask = subspace
+                    .as_ref()
+                    .expect("Subspace aggregation requires <subspace>.");
+                let mask = u128::from_str_radix(mask, 16)
+                    .expect("Could not parse integer. Is it in hexadecimals?");
+                Reducer::Subspace(mask)
+            }
+            _ => panic!("Unknown aggregation, expected output, input or subspace."),
+        }
+    });
+
     println!("\n--------------------------------------- GENERATING GRAPH ---------------------------------------\n");
 
-    let graph = generate_graph(cipher, property_type, rounds, patterns, anchors, &allowed);
+    // Output files of a round sweep are suffixed with their number of rounds
+    let suffix = |path: &str, rounds: usize| match rounds_max {
+        Some(_) => format!("{}.r{}", path, rounds),
+        None => path.to_string(),
+    };
 
-    if let Some(path) = file_graph {
-        dump_to_graph_tool(&graph, &path);
-    }
+    // Each round of a sweep is timed from the end of the previous one
+    let mut round_start = start;
+    let mut search = |rounds: usize, mut graph: FrozenGraph| {
+        let file_mask_out = file_mask_out.as_ref().map(|path| suffix(path, rounds));
+        if let Some(path) = &save_graph {
+            let path = suffix(path, rounds);
+            println!("Saving graph to {}.", path);
+            graph.save(&path, cipher, property_type);
+        }
 
-    if let Some(path) = &file_mask_out {
-        dump_masks(&graph, path);
-    }
+        if targeted && !allowed.is_empty() {
+            // Prince-like ciphers both start and end in the first stage
+            let mut inputs: FnvHashSet<_> = allowed.iter().map(|&(a, _)| a).collect();
+            let mut outputs: FnvHashSet<_> = allowed.iter().map(|&(_, b)| b).collect();
 
-    println!("\n------------------------------------- FINDING PROPERTIES ---------------------------------------\n");
+            if cipher.structure() == CipherStructure::Prince {
+                inputs.extend(outputs.drain());
+            }
 
-    let (result, min_value, paths) =
-        parallel_find_properties(cipher, &graph, property_type, &allowed, keep);
+            let edges = graph.num_edges();
+            let outputs = if outputs.is_empty() {
+                None
+            } else {
+                Some(&outputs)
+            };
+            graph.restrict(Some(&inputs), outputs);
+            println!(
+                "Restricted graph to allowed pairs, from {} to {} edges.",
+                edges,
+                graph.num_edges()
+            );
+        }
 
-    println!("\n------------------------------------------ RESULTS ---------------------------------------------\n");
+        // Only Prince-like ciphers traverse the graph backwards, unless meeting in the middle. The
+        // backward edges aren't needed when combining forward hulls in memory
+        let prince = cipher.structure() == CipherStructure::Prince;
 
-    println!("Search finished. [{:?} s]", start.elapsed().as_secs());
+        if (prince && (!half_graph || spill_dir.is_some()))
+            || (meet_in_middle && !allowed.is_empty())
+        {
+            graph.build_backward();
+        }
 
-    if !result.is_empty() {
-        println!("Smallest value: {}", min_value.log2());
-        println!("Largest value:  {}\n", result[0].value.log2());
-        println!("Total number of trails:  {}", paths);
-    }
+        if pack_graph {
+            let unpacked = graph.edge_bytes();
+            graph.pack();
+            println!(
+                "Packed graph edges from {} to {} bytes.",
+                unpacked,
+                graph.edge_bytes()
+            );
+        }
 
-    for &property in &result {
-        if property.input == 0 && property.output == 0 {
-            continue;
+        if let Some(path) = &spill_dir {
+            println!("Spilling graph edges to {}.", path);
+            graph.spill(path);
         }
 
-        print!("Approximation: {:?} ", property);
-        println!("[{}, {}]", property.trails, property.value.log2());
-    }
+        if let Some(path) = &file_graph {
+            dump_to_graph_tool(&graph, &suffix(path, rounds));
+        }
+
+        if let Some(path) = &file_mask_out {
+            dump_masks(&graph, path);
+        }
+
+        let export = export.map(|(path, value)| {
+            let prefix = format!("{}.export", suffix(path, rounds));
+            Export::new(&prefix, value, export_binary)
+        });
+        let aggregation = reducer.map(Aggregation::new);
+
+        println!("\n------------------------------------- FINDING PROPERTIES ---------------------------------------\n");
+
+        let find_options = FindOptions {
+            meet_in_middle,
+            half_graph,
+            threshold: threshold.map(f64::exp2),
+            export: export.as_ref(),
+            aggregation: aggregation.as_ref(),
+            max_memory: generate.max_memory_bytes(),
+        };
+        let (result, min_value, paths) =
+            parallel_find_properties(cipher, &graph, property_type, &allowed, keep, &find_options);
+
+        println!("\n------------------------------------------ RESULTS ---------------------------------------------\n");
+
+        println!("Search finished. [{:?} s]", round_start.elapsed().as_secs());
+
+        if !result.is_empty() {
+            println!("Smallest value: {}", min_value.log2());
+            println!("Largest value:  {}\n", result[0].value.log2());
+            println!("Total number of trails:  {}", paths);
+        }
+
+        for &property in &result {
+            if property.input == 0 && property.output == 0 {
+                continue;
+            }
+
+            print!("Approximation: {:?} ", property);
+            println!("[{}, {}]", property.trails, property.value.log2());
+        }
+
+        if let (Some(aggregation), Some(path)) = (&aggregation, &file_mask_out) {
+            println!("Aggregated properties in {} groups.", aggregation.len());
+            aggregation.dump(&format!("{}.agg", path));
+        }
+
+        if num_keep.is_some() && file_mask_out.is_some() {
+            dump_results(&result, &file_mask_out.unwrap());
+        }
 
-    if num_keep.is_some() && file_mask_out.is_some() {
-        dump_results(&result, &file_mask_out.unwrap());
+        round_start = Instant::now();
+    };
+
+    match rounds_max {
+        Some(last) => {
+            sweep_graphs(
+                cipher,
+                property_type,
+                rounds,
+                last,
+                &allowed,
+                generate,
+                search,
+            );
+        }
+        None => {
+            let graph = match &load_graph {
+                Some(path) => {
+                    println!("Loading graph from {}.", path);
+                    FrozenGraph::load(path, cipher, property_type, rounds)
+                }
+                None => generate_graph(cipher, property_type, rounds, &allowed, generate),
+            };
+
+            search(rounds, graph);
+        }
     }
 }
@@ -94,6 +94,28 @@ impl<'a> SortedProperties<'a> {
         self.sbox_patterns.len()
     }
 
+    /// Keeps the patterns with the largest values such that at most `max_properties`
+    /// properties can be generated in total. The best pattern is always kept, even if it
+    /// generates more properties on its own.
+    pub fn limit_properties(&mut self, max_properties: usize) {
+        let value_maps = &self.value_maps;
+
+        self.sbox_patterns
+            .sort_by(|a, b| b.value().partial_cmp(&a.value()).expect("Value is NaN."));
+
+        let mut total = 0;
+        let keep = self
+            .sbox_patterns
+            .iter()
+            .take_while(|pattern| {
+                total += pattern.num_prop(value_maps);
+                total <= max_properties
+            })
+            .count()
+            .max(1);
+        self.sbox_patterns.truncate(keep);
+    }
+
     /// Sets the type field to all.
     pub fn set_type_all(&mut self) {
         self.property_filter = PropertyFilter::All;
@@ -153,8 +175,7 @@ impl<'a> SortedProperties<'a> {
                         }
 
                         let input = compress(property.input, level);
-                        let good = graph.forward_edges().contains_key(&input)
-                            || graph.backward_edges().contains_key(&input);
+                        let good = graph.contains_vertex(input);
                         good_patterns[pattern_idx] |= good;
 
                         if t == 0 {
@@ -0,0 +1,126 @@
+//! A set of masks which can be filled concurrently from several threads.
+
+use fnv::{FnvHashSet, FnvHasher};
+use std::hash::Hasher;
+use std::sync::Mutex;
+
+// The number of masks buffered for a stripe before its lock is taken
+const BATCH_SIZE: usize = 1 << 10;
+
+/// Returns the stripe of a mask in a set with the given number of stripes.
+fn stripe_of(x: u128, num_stripes: usize) -> usize {
+    let mut hasher = FnvHasher::default();
+    hasher.write_u128(x);
+    (hasher.finish() % num_stripes as u64) as usize
+}
+
+/// A hash set split into stripes by the hash of each mask, each behind its own lock. Two sets
+/// with the same number of stripes place equal masks in stripes with the same index, so they
+/// can be intersected stripe by stripe.
+pub struct StripedSet {
+    stripes: Vec<Mutex<FnvHashSet<u128>>>,
+}
+
+impl StripedSet {
+    /// Creates an empty set with a fixed number of stripes.
+    pub fn new(num_stripes: usize) -> StripedSet {
+        StripedSet {
+            stripes: (0..num_stripes)
+                .map(|_| Mutex::new(FnvHashSet::default()))
+                .collect(),
+        }
+    }
+
+    /// Returns a handle for inserting masks from a single thread.
+    pub fn inserter(&self) -> Inserter<'_> {
+        Inserter {
+            set: self,
+            buffers: vec![Vec::new(); self.stripes.len()],
+        }
+    }
+
+    /// Returns the stripes of the set.
+    pub fn into_stripes(self) -> Vec<FnvHashSet<u128>> {
+        self.stripes
+            .into_iter()
+            .map(|stripe| stripe.into_inner().expect("Could not lock set."))
+            .collect()
+    }
+}
+
+/// Buffers the masks inserted by one thread and adds them to their stripes in batches.
+pub struct Inserter<'a> {
+    set: &'a StripedSet,
+    buffers: Vec<Vec<u128>>,
+}
+
+impl<'a> Inserter<'a> {
+    /// Adds the buffered masks of a stripe to the set.
+    fn flush(&mut self, stripe: usize) {
+        self.set.stripes[stripe]
+            .lock()
+            .expect("Could not lock set.")
+            .extend(self.buffers[stripe].drain(..));
+    }
+
+    /// Inserts a mask into the set. The mask may not be visible to other threads until the
+    /// inserter is finished.
+    pub fn insert(&mut self, x: u128) {
+        let stripe = stripe_of(x, self.buffers.len());
+        self.buffers[stripe].push(x);
+
+        if self.buffers[stripe].len() >= BATCH_SIZE {
+            self.flush(stripe);
+        }
+    }
+
+    /// Adds all remaining buffered masks to the set.
+    pub fn finish(mut self) {
+        for stripe in 0..self.buffers.len() {
+            if !self.buffers[stripe].is_empty() {
+                self.flush(stripe);
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{stripe_of, StripedSet};
+    use crossbeam_utils;
+    use fnv::FnvHashSet;
+
+    #[test]
+    fn striped_set_matches_serial_set() {
+        let set = StripedSet::new(16);
+        let serial: FnvHashSet<u128> = (0..4)
+            .flat_map(|t| (0..5000).map(move |i| (i * (t + 1)) % 7919))
+            .collect();
+
+        crossbeam_utils::thread::scope(|scope| {
+            for t in 0..4 {
+                let set = &set;
+
+                scope.spawn(move |_| {
+                    let mut inserter = set.inserter();
+
+                    for i in 0..5000 {
+                        inserter.insert((i * (t + 1)) % 7919);
+                    }
+
+                    inserter.finish();
+                });
+            }
+        })
+        .expect("Threads failed to join.");
+
+        let stripes = set.into_stripes();
+
+        for (i, stripe) in stripes.iter().enumerate() {
+            assert!(stripe.iter().all(|&x| stripe_of(x, 16) == i));
+        }
+
+        let merged: FnvHashSet<u128> = stripes.into_iter().flatten().collect();
+        assert_eq!(merged, serial);
+    }
+}